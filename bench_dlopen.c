@@ -0,0 +1,237 @@
+// Measures what the generated layout and hash tables cost at runtime, by doing what run_full.c does,
+// on the libraries of bench_workload.h from 10 up to MAX_SYMBOLS symbols, for every hash style, with and without -O1,
+// and with both the default and the --compact layout
+//
+// Every library is loaded in a fresh child process, which reports the dlopen() latency,
+// the latency distribution of dlsym() on every exported name (hits) and on every exported name with "_x" appended (misses),
+// and how many page faults and how much RSS getrusage() says both of those added
+// The fastest of the repetitions is printed as CSV
+
+#define GENERATE_FULL_SO_NO_MAIN
+#include "generate_full_so.c"
+#include "bench_workload.h"
+
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <math.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define REPETITIONS 5
+#define MAX_NAME_SIZE 64
+
+static char *hash_style_names[] = {[HASH_STYLE_SYSV] = "sysv", [HASH_STYLE_GNU] = "gnu", [HASH_STYLE_BOTH] = "both"};
+
+static char directory[] = "/tmp/bench_dlopen_XXXXXX";
+
+static char (*hit_names)[MAX_NAME_SIZE];
+static char (*miss_names)[MAX_NAME_SIZE];
+
+// Scratch space of the child, for sorting the latencies
+static u64 hit_nanoseconds[MAX_SYMBOLS];
+static u64 miss_nanoseconds[MAX_SYMBOLS];
+
+#define PERCENTILE_COUNT 4
+
+static char *percentile_names[PERCENTILE_COUNT] = {"p50", "p90", "p99", "max"};
+static double percentiles[PERCENTILE_COUNT] = {0.5, 0.9, 0.99, 1};
+
+// What a child sends back to the parent, through a shared mapping
+struct result {
+    double dlopen_seconds;
+    long dlopen_minor_faults;
+    long dlopen_major_faults;
+    long dlopen_rss_kib;
+    long dlsym_minor_faults;
+    long dlsym_rss_kib;
+    u64 hit_percentiles[PERCENTILE_COUNT];
+    u64 miss_percentiles[PERCENTILE_COUNT];
+};
+
+static void wait_for_child(pid_t pid, char *what) {
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "error: %s failed\n", what);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Generating happens in a child, so its memory doesn't count towards the RSS of the dlopen() children
+static void generate(char *source_path, char *output_path, enum hash_style hash_style, bool optimize_hash_buckets, bool compact) {
+    pid_t pid = fork_checked();
+    if (pid == 0) {
+        struct context *options = create_context();
+        options->hash_style = hash_style;
+        options->optimize_hash_buckets = optimize_hash_buckets;
+        options->separate_code = !compact;
+        options->relro = !compact;
+        generate_full_so_file(source_path, output_path, options);
+        _exit(EXIT_SUCCESS);
+    }
+
+    wait_for_child(pid, "generate_full_so");
+}
+
+static u64 get_nanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    u64 x = *(const u64 *)a;
+    u64 y = *(const u64 *)b;
+    return (x > y) - (x < y);
+}
+
+static void get_percentiles(u64 *nanoseconds, size_t count, u64 *result_percentiles) {
+    qsort(nanoseconds, count, sizeof(*nanoseconds), compare_u64);
+
+    for (size_t i = 0; i < PERCENTILE_COUNT; i++) {
+        size_t index = percentiles[i] * (count - 1);
+        result_percentiles[i] = nanoseconds[index];
+    }
+}
+
+// Times every dlsym() call on its own, so the distribution shows how long the chains are
+static void time_dlsym(void *handle, char (*names)[MAX_NAME_SIZE], size_t symbol_count, bool should_hit, u64 *nanoseconds) {
+    for (size_t i = 0; i < symbol_count; i++) {
+        u64 start = get_nanoseconds();
+        void *symbol = dlsym(handle, names[i]);
+        nanoseconds[i] = get_nanoseconds() - start;
+
+        if ((symbol != NULL) != should_hit) {
+            fprintf(stderr, "error: dlsym() of \"%s\" %s\n", names[i], should_hit ? "missed" : "hit");
+            _exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void run_dlopen(char *output_path, size_t symbol_count, struct result *result) {
+    pid_t pid = fork_checked();
+    if (pid == 0) {
+        // The child inherits the peak RSS of the parent, so only growth of it is reported,
+        // and the latency arrays are faulted in up front, so they don't count as growth
+        memset(hit_nanoseconds, 0, sizeof(hit_nanoseconds));
+        memset(miss_nanoseconds, 0, sizeof(miss_nanoseconds));
+
+        struct rusage before;
+        getrusage(RUSAGE_SELF, &before);
+        double start = get_seconds();
+
+        void *handle = dlopen(output_path, RTLD_NOW);
+        if (!handle) {
+            fprintf(stderr, "dlopen: %s\n", dlerror());
+            _exit(EXIT_FAILURE);
+        }
+
+        result->dlopen_seconds = get_seconds() - start;
+        struct rusage after;
+        getrusage(RUSAGE_SELF, &after);
+        result->dlopen_minor_faults = after.ru_minflt - before.ru_minflt;
+        result->dlopen_major_faults = after.ru_majflt - before.ru_majflt;
+        result->dlopen_rss_kib = after.ru_maxrss - before.ru_maxrss;
+        before = after;
+
+        time_dlsym(handle, hit_names, symbol_count, true, hit_nanoseconds);
+
+        time_dlsym(handle, miss_names, symbol_count, false, miss_nanoseconds);
+
+        // Measured before sorting, since qsort() may allocate
+        getrusage(RUSAGE_SELF, &after);
+        result->dlsym_minor_faults = after.ru_minflt - before.ru_minflt;
+        result->dlsym_rss_kib = after.ru_maxrss - before.ru_maxrss;
+
+        get_percentiles(hit_nanoseconds, symbol_count, result->hit_percentiles);
+        get_percentiles(miss_nanoseconds, symbol_count, result->miss_percentiles);
+
+        dlclose(handle);
+        _exit(EXIT_SUCCESS);
+    }
+
+    wait_for_child(pid, "dlopen");
+}
+
+static void bench(char *source_path, char *output_path, size_t symbol_count, enum hash_style hash_style, bool optimize_hash_buckets, bool compact, struct result *result) {
+    generate(source_path, output_path, hash_style, optimize_hash_buckets, compact);
+
+    // The fastest repetition is reported, since it is the least disturbed by the rest of the machine
+    struct result best = {.dlopen_seconds = INFINITY};
+    for (size_t repetition = 0; repetition < REPETITIONS; repetition++) {
+        run_dlopen(output_path, symbol_count, result);
+        if (result->dlopen_seconds < best.dlopen_seconds) {
+            best = *result;
+        }
+    }
+
+    printf("%zu,%s,%d,%d,%.3f,%ld,%ld,%ld,%ld,%ld", symbol_count, hash_style_names[hash_style], optimize_hash_buckets, compact, best.dlopen_seconds * 1e6, best.dlopen_minor_faults, best.dlopen_major_faults, best.dlopen_rss_kib, best.dlsym_minor_faults, best.dlsym_rss_kib);
+    for (size_t i = 0; i < PERCENTILE_COUNT; i++) {
+        printf(",%" PRIu64, best.hit_percentiles[i]);
+    }
+    for (size_t i = 0; i < PERCENTILE_COUNT; i++) {
+        printf(",%" PRIu64, best.miss_percentiles[i]);
+    }
+    printf("\n");
+}
+
+int main(void) {
+    if (!mkdtemp(directory)) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+
+    char source_path[256];
+    char output_path[256];
+    snprintf(source_path, sizeof(source_path), "%s/bench.s", directory);
+    snprintf(output_path, sizeof(output_path), "%s/bench.so", directory);
+
+    hit_names = malloc(MAX_SYMBOLS * sizeof(*hit_names));
+    miss_names = malloc(MAX_SYMBOLS * sizeof(*miss_names));
+    if (!hit_names || !miss_names) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < MAX_SYMBOLS; i++) {
+        get_symbol_name(hit_names[i], MAX_NAME_SIZE, i);
+        snprintf(miss_names[i], MAX_NAME_SIZE, "%s_x", hit_names[i]);
+    }
+
+    struct result *result = mmap(NULL, sizeof(*result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("symbols,hash_style,optimize_hash_buckets,compact,dlopen_us,dlopen_minor_faults,dlopen_major_faults,dlopen_rss_kib,dlsym_minor_faults,dlsym_rss_kib");
+    for (size_t i = 0; i < PERCENTILE_COUNT; i++) {
+        printf(",hit_%s_ns", percentile_names[i]);
+    }
+    for (size_t i = 0; i < PERCENTILE_COUNT; i++) {
+        printf(",miss_%s_ns", percentile_names[i]);
+    }
+    printf("\n");
+
+    enum hash_style hash_styles[] = {HASH_STYLE_SYSV, HASH_STYLE_GNU, HASH_STYLE_BOTH};
+
+    for (size_t i = 0; i < sizeof(symbol_counts) / sizeof(*symbol_counts); i++) {
+        size_t symbol_count = symbol_counts[i];
+
+        write_source(source_path, symbol_count);
+
+        for (size_t j = 0; j < sizeof(hash_styles) / sizeof(*hash_styles); j++) {
+            for (int compact = 0; compact < 2; compact++) {
+                bench(source_path, output_path, symbol_count, hash_styles[j], false, compact, result);
+                bench(source_path, output_path, symbol_count, hash_styles[j], true, compact, result);
+            }
+        }
+    }
+
+    unlink(source_path);
+    unlink(output_path);
+    rmdir(directory);
+}
@@ -0,0 +1,291 @@
+// Measures how many iTLB misses calling megabytes of generated code causes,
+// with the default layout and with --huge-page-text, by running the calls under `perf stat`
+//
+// Every function gets a page of its own, so calling all of them in a loop needs more iTLB entries than any CPU has,
+// unless the kernel backed .text with huge pages, which only happens when it is aligned to one
+// The results are printed as CSV, and the perf columns are left empty when perf isn't installed
+
+#define GENERATE_FULL_SO_NO_MAIN
+#include "generate_full_so.c"
+
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <sys/wait.h>
+
+#define FUNCTION_COUNT 2048
+#define ROUNDS 200
+
+// Pads every function to about a page, after its `ret`
+#define PADDING_QWORDS 511
+#define PADDING_QWORDS_PER_LINE 73
+
+// Added in Linux 6.1, so older headers don't have it yet
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+static char directory[] = "/tmp/bench_itlb_XXXXXX";
+
+static void write_source(char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < FUNCTION_COUNT; i++) {
+        fprintf(f, "global fn_%zu\n", i);
+    }
+
+    fprintf(f, "\nsection .text\n\n");
+    for (size_t i = 0; i < FUNCTION_COUNT; i++) {
+        fprintf(f, "fn_%zu:\n\tmov rax, %zu\n\tret\n", i, i);
+
+        for (size_t j = 0; j < PADDING_QWORDS; j += PADDING_QWORDS_PER_LINE) {
+            fprintf(f, "\tdq 0");
+            for (size_t k = 1; k < PADDING_QWORDS_PER_LINE; k++) {
+                fprintf(f, ", 0");
+            }
+            fprintf(f, "\n");
+        }
+    }
+
+    fclose(f);
+}
+
+static void generate(char *source_path, char *output_path, bool huge_page_text) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0) {
+        struct context *options = create_context();
+        if (huge_page_text) {
+            options->max_page_size = HUGE_PAGE_SIZE;
+            options->pad_text_segment = true;
+        }
+        generate_full_so_file(source_path, output_path, options);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "error: generate_full_so failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Returns how many KiB of the mapping containing the address the kernel backs with file huge pages
+static long get_file_pmd_mapped_kib(void *address) {
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    char line[512];
+    bool is_in_mapping = false;
+    long kib = 0;
+    while (fgets(line, sizeof(line), f)) {
+        uintptr_t start;
+        uintptr_t end;
+        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &start, &end) == 2) {
+            is_in_mapping = (uintptr_t)address >= start && (uintptr_t)address < end;
+        } else if (is_in_mapping && sscanf(line, "FilePmdMapped: %ld kB", &kib) == 1) {
+            break;
+        }
+    }
+
+    fclose(f);
+    return kib;
+}
+
+// What runs under perf: calls every function in the library ROUNDS times,
+// and prints the nanoseconds per call and how much of .text is backed by huge pages
+static void run_calls(char *path) {
+    void *handle = dlopen(path, RTLD_NOW);
+    if (!handle) {
+        fprintf(stderr, "dlopen: %s\n", dlerror());
+        exit(EXIT_FAILURE);
+    }
+
+    static u64 (*functions[FUNCTION_COUNT])(void);
+    static void *addresses[FUNCTION_COUNT];
+    for (size_t i = 0; i < FUNCTION_COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "fn_%zu", i);
+
+        addresses[i] = dlsym(handle, name);
+        if (!addresses[i]) {
+            fprintf(stderr, "dlsym: %s\n", dlerror());
+            exit(EXIT_FAILURE);
+        }
+
+        // Going through void ** is how POSIX recommends converting dlsym() its result to a function pointer
+        *(void **)&functions[i] = addresses[i];
+    }
+
+    // Asks the kernel to back .text with huge pages right away, instead of whenever khugepaged gets to it
+    // Either can fail, like when the kernel doesn't support huge pages for files, which the FilePmdMapped column then shows
+    uintptr_t text_start = (uintptr_t)addresses[0] & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    uintptr_t text_end = align_up((uintptr_t)addresses[FUNCTION_COUNT - 1], HUGE_PAGE_SIZE);
+    madvise((void *)text_start, text_end - text_start, MADV_HUGEPAGE);
+    madvise((void *)text_start, text_end - text_start, MADV_COLLAPSE);
+
+    u64 sum = 0;
+    double start = get_seconds();
+    for (size_t round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < FUNCTION_COUNT; i++) {
+            sum += functions[i]();
+        }
+    }
+    double seconds = get_seconds() - start;
+
+    if (sum != (u64)ROUNDS * FUNCTION_COUNT * (FUNCTION_COUNT - 1) / 2) {
+        fprintf(stderr, "error: The functions returned the wrong values\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%.3f,%ld\n", seconds / (ROUNDS * FUNCTION_COUNT) * 1e9, get_file_pmd_mapped_kib(addresses[0]));
+
+    dlclose(handle);
+}
+
+// Returns the exit status of the command, which is 127 when the shell couldn't execute it,
+// and reads the line that run_calls() printed
+static int run_command(char *command, char *output, size_t output_size) {
+    FILE *f = popen(command, "r");
+    if (!f) {
+        perror("popen");
+        exit(EXIT_FAILURE);
+    }
+
+    output[0] = '\0';
+    if (fgets(output, output_size, f)) {
+        output[strcspn(output, "\n")] = '\0';
+    }
+
+    int status = pclose(f);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+// Reads the value of an event from the output of `perf stat -x,`, which can also be "<not supported>"
+static void read_perf_event(char *stats_path, char *event, char *value, size_t value_size) {
+    FILE *f = fopen(stats_path, "r");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    value[0] = '\0';
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        // The fields are the value, the unit and the event name
+        char *name = strchr(line, ',');
+        if (!name || !(name = strchr(name + 1, ','))) {
+            continue;
+        }
+        name++;
+
+        size_t event_length = strlen(event);
+        if (strncmp(name, event, event_length) == 0 && name[event_length] == ',') {
+            snprintf(value, value_size, "%.*s", (int)strcspn(line, ","), line);
+            break;
+        }
+    }
+
+    fclose(f);
+}
+
+static long get_file_size(char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        perror("stat");
+        exit(EXIT_FAILURE);
+    }
+    return st.st_size;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "--run") == 0) {
+        run_calls(argv[2]);
+        return EXIT_SUCCESS;
+    }
+
+    char self_path[256];
+    ssize_t self_path_length = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+    if (self_path_length == -1) {
+        perror("readlink");
+        exit(EXIT_FAILURE);
+    }
+    self_path[self_path_length] = '\0';
+
+    if (!mkdtemp(directory)) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+
+    char source_path[256];
+    char output_path[256];
+    char stats_path[256];
+    snprintf(source_path, sizeof(source_path), "%s/bench.s", directory);
+    snprintf(output_path, sizeof(output_path), "%s/bench.so", directory);
+    snprintf(stats_path, sizeof(stats_path), "%s/stats.csv", directory);
+
+    write_source(source_path);
+
+    bool has_perf = true;
+
+    printf("layout,file_bytes,ns_per_call,file_pmd_mapped_kib,itlb_load_misses,itlb_loads\n");
+
+    char *layout_names[] = {"default", "huge-page-text"};
+
+    for (size_t i = 0; i < 2; i++) {
+        bool huge_page_text = i == 1;
+
+        generate(source_path, output_path, huge_page_text);
+
+        char command[1024];
+        char output[256];
+        char misses[64] = "";
+        char loads[64] = "";
+
+        if (has_perf) {
+            snprintf(command, sizeof(command), "perf stat -x, -o %s -e iTLB-load-misses,iTLB-loads %s --run %s 2>/dev/null", stats_path, self_path, output_path);
+            int status = run_command(command, output, sizeof(output));
+            if (status == 127) {
+                fprintf(stderr, "warning: Leaving the perf columns empty, since perf couldn't be executed\n");
+                has_perf = false;
+            } else if (status != EXIT_SUCCESS) {
+                fprintf(stderr, "error: perf stat failed on %s\n", output_path);
+                exit(EXIT_FAILURE);
+            } else {
+                read_perf_event(stats_path, "iTLB-load-misses", misses, sizeof(misses));
+                read_perf_event(stats_path, "iTLB-loads", loads, sizeof(loads));
+            }
+        }
+
+        if (!has_perf) {
+            snprintf(command, sizeof(command), "%s --run %s", self_path, output_path);
+            if (run_command(command, output, sizeof(output)) != EXIT_SUCCESS) {
+                fprintf(stderr, "error: Calling the functions in %s failed\n", output_path);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        printf("%s,%ld,%s,%s,%s\n", layout_names[i], get_file_size(output_path), output, misses, loads);
+        fflush(stdout);
+    }
+
+    unlink(source_path);
+    unlink(output_path);
+    unlink(stats_path);
+    rmdir(directory);
+}
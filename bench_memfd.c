@@ -0,0 +1,72 @@
+// Measures the latency of getting a freshly generated full.so into this process,
+// like run_full.c does, by generating it, dlopen()ing it, and calling fn1_c()
+//
+// The "disk" rows write full.so with the buffer and mmap backends, and dlopen() "./full.so",
+// while the "memfd" row dlopen()s the memfd_create() file through "/proc/self/fd/<fd>"
+
+#define GENERATE_FULL_SO_NO_MAIN
+#include "generate_full_so.c"
+
+#include <dlfcn.h>
+
+#define ITERATIONS 2000
+
+static struct context *options;
+
+static void call_fn1_c(char *path) {
+    void *handle = dlopen(path, RTLD_NOW);
+    if (!handle) {
+        fprintf(stderr, "dlopen: %s\n", dlerror());
+        exit(EXIT_FAILURE);
+    }
+
+    // Going through void ** is how POSIX recommends converting dlsym() its result to a function pointer
+    int (*fn1_c)(void);
+    *(void **)&fn1_c = dlsym(handle, "fn1_c");
+    if (!fn1_c) {
+        fprintf(stderr, "dlsym: %s\n", dlerror());
+        exit(EXIT_FAILURE);
+    }
+    if (fn1_c() != 42) {
+        fprintf(stderr, "error: fn1_c() didn't return 42\n");
+        exit(EXIT_FAILURE);
+    }
+
+    dlclose(handle);
+}
+
+static void report(char *name, double seconds) {
+    printf("%-16s %10.2f us per generate + dlopen + dlsym + dlclose\n", name, seconds / ITERATIONS * 1e6);
+}
+
+static void bench_disk(char *name, enum output_backend backend) {
+    double start = get_seconds();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        options->output_backend = backend;
+        generate_full_so_file("full.s", "full.so", options);
+        call_fn1_c("./full.so");
+    }
+    report(name, get_seconds() - start);
+}
+
+static void bench_memfd(void) {
+    double start = get_seconds();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        int fd = generate_full_so_memfd("full.s", options);
+
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        call_fn1_c(path);
+
+        close(fd);
+    }
+    report("memfd", get_seconds() - start);
+}
+
+int main(void) {
+    options = create_context();
+
+    bench_disk("disk buffer", OUTPUT_BACKEND_BUFFER);
+    bench_disk("disk mmap", OUTPUT_BACKEND_MMAP);
+    bench_memfd();
+}
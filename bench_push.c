@@ -0,0 +1,80 @@
+// Measures how many bytes per second the push_*() primitives of generate_full_so.c emit
+// for the hot paths: .symtab/.dynsym entries, and the ELF and section headers
+//
+// The "bytewise" rows use the old push_number(), which pushed one byte at a time,
+// so the two can be compared on the same machine
+
+#define GENERATE_FULL_SO_NO_MAIN
+#include "generate_full_so.c"
+
+#define SYMBOL_ENTRY_COUNT 1000000
+#define HEADER_REPETITIONS 30000
+
+static void push_number_bytewise(u64 n, size_t byte_count) {
+    while (n > 0) {
+        // Little-endian requires the least significant byte first
+        push_byte(n & 0xff);
+        byte_count--;
+
+        n >>= 8; // Shift right by one byte
+    }
+
+    // Optional padding
+    for (size_t i = 0; i < byte_count; i++) {
+        push_byte(0);
+    }
+}
+
+static void push_symbol_entry_bytewise(u32 name, u16 info, u16 shndx, u32 offset) {
+    push_number_bytewise(name, 4);
+    push_number_bytewise(info, 2);
+    push_number_bytewise(shndx, 2);
+    push_number_bytewise(offset, 4);
+    push_number_bytewise(0, SYMTAB_ENTRY_SIZE - 12);
+}
+
+static void report(char *name, double seconds) {
+    printf("%-24s %10zu bytes %10.3f ms %10.1f MB/s\n", name, ctx->bytes_size, seconds * 1e3, ctx->bytes_size / seconds / 1e6);
+}
+
+static void bench_symbol_entries(void) {
+    ctx->bytes_size = 0;
+    double start = get_seconds();
+    for (u32 i = 0; i < SYMBOL_ENTRY_COUNT; i++) {
+        push_symbol_entry(i * 7, ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 7, ctx->data_offset + i);
+    }
+    report("symbol entries", get_seconds() - start);
+
+    ctx->bytes_size = 0;
+    start = get_seconds();
+    for (u32 i = 0; i < SYMBOL_ENTRY_COUNT; i++) {
+        push_symbol_entry_bytewise(i * 7, ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 7, ctx->data_offset + i);
+    }
+    report("symbol entries bytewise", get_seconds() - start);
+}
+
+static void bench_headers(void) {
+    init_section_header_indices();
+    init_section_names();
+    init_layout();
+
+    ctx->bytes_size = 0;
+    double start = get_seconds();
+    for (size_t i = 0; i < HEADER_REPETITIONS; i++) {
+        push_elf_header();
+        push_section_headers();
+    }
+    report("headers", get_seconds() - start);
+}
+
+int main(void) {
+    ctx = create_context();
+
+    // Reserving and touching the buffer up front,
+    // so that growing it and page faults aren't part of the measurements
+    reserve_bytes(SYMBOL_ENTRY_COUNT * SYMTAB_ENTRY_SIZE);
+    memset(ctx->bytes, 0, ctx->bytes_capacity);
+
+    bench_symbol_entries();
+    bench_headers();
+}
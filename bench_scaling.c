@@ -0,0 +1,158 @@
+// Measures how generate_full_so.c scales from 10 up to MAX_SYMBOLS symbols,
+// next to `nasm -f elf64` + `ld -shared --hash-style=sysv` on the same source
+//
+// Every run happens in a child process, so that its peak RSS can be read from wait4()
+// The results are printed as CSV, and the nasm + ld rows are skipped when nasm isn't installed
+
+#define GENERATE_FULL_SO_NO_MAIN
+#include "generate_full_so.c"
+#include "bench_workload.h"
+
+#include <math.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define REPETITIONS 3
+
+static char directory[] = "/tmp/bench_scaling_XXXXXX";
+
+// Returns the exit status of the child, and adds its wall time and peak RSS
+static int wait_for_child(pid_t pid, double start, double *seconds, long *peak_rss_kib) {
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4");
+        exit(EXIT_FAILURE);
+    }
+
+    *seconds += get_seconds() - start;
+    if (usage.ru_maxrss > *peak_rss_kib) {
+        *peak_rss_kib = usage.ru_maxrss;
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+static void run_generator(char *source_path, char *output_path, double *seconds, long *peak_rss_kib) {
+    double start = get_seconds();
+
+    pid_t pid = fork_checked();
+    if (pid == 0) {
+        generate_full_so_file(source_path, output_path, create_context());
+        _exit(EXIT_SUCCESS);
+    }
+
+    if (wait_for_child(pid, start, seconds, peak_rss_kib) != EXIT_SUCCESS) {
+        fprintf(stderr, "error: generate_full_so failed on %s\n", source_path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Returns the exit status of the command, which is 127 when it couldn't be executed
+static int run_command(char *argv[], double *seconds, long *peak_rss_kib) {
+    double start = get_seconds();
+
+    pid_t pid = fork_checked();
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    return wait_for_child(pid, start, seconds, peak_rss_kib);
+}
+
+// Returns false when nasm or ld couldn't be executed
+static bool run_nasm_and_ld(char *source_path, char *object_path, char *output_path, double *seconds, long *peak_rss_kib) {
+    char *nasm_argv[] = {"nasm", "-f", "elf64", source_path, "-o", object_path, NULL};
+    int status = run_command(nasm_argv, seconds, peak_rss_kib);
+    if (status == 127) {
+        return false;
+    }
+    if (status != EXIT_SUCCESS) {
+        fprintf(stderr, "error: nasm failed on %s\n", source_path);
+        exit(EXIT_FAILURE);
+    }
+
+    char *ld_argv[] = {"ld", "-shared", "--hash-style=sysv", object_path, "-o", output_path, NULL};
+    status = run_command(ld_argv, seconds, peak_rss_kib);
+    if (status == 127) {
+        return false;
+    }
+    if (status != EXIT_SUCCESS) {
+        fprintf(stderr, "error: ld failed on %s\n", object_path);
+        exit(EXIT_FAILURE);
+    }
+
+    return true;
+}
+
+static long get_file_size(char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        perror("stat");
+        exit(EXIT_FAILURE);
+    }
+    return st.st_size;
+}
+
+int main(void) {
+    if (!mkdtemp(directory)) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+
+    char source_path[256];
+    char object_path[256];
+    char output_path[256];
+    snprintf(source_path, sizeof(source_path), "%s/bench.s", directory);
+    snprintf(object_path, sizeof(object_path), "%s/bench.o", directory);
+    snprintf(output_path, sizeof(output_path), "%s/bench.so", directory);
+
+    bool has_nasm = true;
+
+    printf("symbols,tool,wall_seconds,peak_rss_kib,output_bytes\n");
+
+    for (size_t i = 0; i < sizeof(symbol_counts) / sizeof(*symbol_counts); i++) {
+        size_t symbol_count = symbol_counts[i];
+
+        write_source(source_path, symbol_count);
+
+        // The fastest repetition is reported, since it is the least disturbed by the rest of the machine
+        double best_seconds = INFINITY;
+        long peak_rss_kib = 0;
+        for (size_t repetition = 0; repetition < REPETITIONS; repetition++) {
+            double seconds = 0;
+            run_generator(source_path, output_path, &seconds, &peak_rss_kib);
+            if (seconds < best_seconds) {
+                best_seconds = seconds;
+            }
+        }
+        printf("%zu,generate_full_so,%.6f,%ld,%ld\n", symbol_count, best_seconds, peak_rss_kib, get_file_size(output_path));
+        fflush(stdout);
+
+        if (!has_nasm) {
+            continue;
+        }
+
+        best_seconds = INFINITY;
+        peak_rss_kib = 0;
+        for (size_t repetition = 0; repetition < REPETITIONS && has_nasm; repetition++) {
+            double seconds = 0;
+            has_nasm = run_nasm_and_ld(source_path, object_path, output_path, &seconds, &peak_rss_kib);
+            if (seconds < best_seconds) {
+                best_seconds = seconds;
+            }
+        }
+        if (!has_nasm) {
+            fprintf(stderr, "warning: Skipping nasm + ld, since they couldn't be executed\n");
+            continue;
+        }
+        printf("%zu,nasm+ld,%.6f,%ld,%ld\n", symbol_count, best_seconds, peak_rss_kib, get_file_size(output_path));
+        fflush(stdout);
+    }
+
+    unlink(source_path);
+    unlink(object_path);
+    unlink(output_path);
+    rmdir(directory);
+}
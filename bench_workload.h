@@ -0,0 +1,63 @@
+// The libraries that bench_scaling.c and bench_dlopen.c generate, so both of them measure the same workload
+// Has to be included after generate_full_so.c
+
+// The names look like "parser_get_size_12", and every tenth one looks like "get_size_12",
+// which is a suffix of the other names with the same verb and number, so it gets tail merged
+static char *modules[] = {"", "buffer", "parser", "window", "socket", "texture", "mesh", "audio", "thread", "string"};
+static char *verbs[] = {"init", "free", "get_size", "set_size", "update", "draw", "read", "write", "reset", "clone"};
+
+static size_t symbol_counts[] = {10, 100, 1000, 10000, 100000, MAX_SYMBOLS};
+
+static void get_symbol_name(char *name, size_t name_size, size_t i) {
+    char *module = modules[i % 10];
+    char *verb = verbs[(i / 10) % 10];
+    size_t number = i / 100;
+
+    if (module[0] == '\0') {
+        snprintf(name, name_size, "%s_%zu", verb, number);
+    } else {
+        snprintf(name, name_size, "%s_%s_%zu", module, verb, number);
+    }
+}
+
+// Half of the symbols are data, and the other half are functions
+static void write_source(char *path, size_t symbol_count) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    char name[64];
+
+    for (size_t i = 0; i < symbol_count; i++) {
+        get_symbol_name(name, sizeof(name), i);
+        fprintf(f, "global %s\n", name);
+    }
+
+    fprintf(f, "\nsection .data\n\n");
+    for (size_t i = 0; i < symbol_count / 2; i++) {
+        get_symbol_name(name, sizeof(name), i);
+        fprintf(f, "%s: dq %zu\n", name, i);
+    }
+
+    fprintf(f, "\nsection .text\n\n");
+    for (size_t i = symbol_count / 2; i < symbol_count; i++) {
+        get_symbol_name(name, sizeof(name), i);
+        fprintf(f, "%s:\n\tmov rax, %zu\n\tret\n", name, i);
+    }
+
+    fclose(f);
+}
+
+static pid_t fork_checked(void) {
+    // Otherwise the child would print the parent its buffered output again
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    return pid;
+}
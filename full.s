@@ -12,7 +12,7 @@ global h
 global fn1_c
 global fn2_c
 
-section .data
+section .rodata
 
 define:
 	dw 1337
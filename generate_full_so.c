@@ -1,30 +1,100 @@
+#define _GNU_SOURCE // For mremap()
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define MAX_BYTES 420420
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_BYTES_CAPACITY 0x1000
+#define MAX_JOBS 100000
 #define MAX_SYMBOLS 420420
 
+// A power of two that is over twice MAX_SYMBOLS, so probing the table of globals stays short
+#define GLOBALS_TABLE_SIZE 0x100000
+
+#define BFD_HASH_DEFAULT_SIZE 4051 // From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/hash.c#l345
+
+// The prime that ld its symbol hash table grows to when it holds MAX_SYMBOLS
+#define MAX_BFD_HASH_SIZE 1048573
+
+// The number of entries ld its symbol hash table holds before the global symbols are added
+// Only their count matters, since they never end up in the symbol tables of the output
+#define BFD_HASH_PRESENT_ENTRIES 2
+
 #define MAX_HASH_BUCKETS 32771 // From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elflink.c;h=6db6a9c0b4702c66d73edba87294e2a59ffafcf5;hb=refs/heads/master#l6560
 
-// TODO: These need to be able to grow
-#define TEXT_OFFSET 0x1000
-#define EH_FRAME_OFFSET 0x2000
-#define DYNAMIC_OFFSET 0x2f50
-#define DATA_OFFSET 0x3000
+// -O1 tries bucket counts up to twice the number of symbols, so it isn't capped at MAX_HASH_BUCKETS
+#define MAX_OPTIMIZED_HASH_BUCKETS (2 * MAX_SYMBOLS)
+
+// hash_symbols() hashes this many symbols at once per thread
+#define HASH_LANES 8
+
+// Starting a thread isn't worth it for fewer symbols than this
+#define MIN_SYMBOLS_PER_HASH_THREAD 65536
+#define MAX_HASH_THREADS 64
 
+// ld its -O1 stops searching for a better bucket count after this many tries without improvement
+#define MAX_BUCKET_COUNT_TRIES_WITHOUT_IMPROVEMENT 100
+
+// ld its MAXPAGESIZE and COMMONPAGESIZE on x86-64
+#define PAGE_SIZE 0x1000
+
+// The size of a transparent huge page on x86-64, which --huge-page-text uses as MAXPAGESIZE
+#define HUGE_PAGE_SIZE 0x200000
+
+#define ELF_HEADER_SIZE 0x40
+#define PROGRAM_HEADER_SIZE 0x38
+#define SECTION_HEADER_SIZE 0x40
+#define DYNAMIC_ENTRY_SIZE 0x10
 #define SYMTAB_ENTRY_SIZE 24
+#define RELA_ENTRY_SIZE 24
+#define RELR_ENTRY_SIZE 8
+
+// The .symtab entries before the global symbols: null, the source file, the unnamed file and "_DYNAMIC"
+#define SYMTAB_LOCAL_ENTRY_COUNT 4
+
+#define MAX_SECTION_NAMES 16
+
+// --incremental reserves room for this many more symbols and bytes after every section that can grow,
+// on top of a quarter of what the section already holds
+#define MIN_SLACK_SYMBOLS 64
+#define MIN_SLACK_BYTES 4096
+
+// The first 8 bytes of a <output>.layout file, which change whenever struct saved_layout does
+#define SAVED_LAYOUT_MAGIC 0x3674756f79616c2eULL // ".layout6"
+
+// Mixed into every --cache-dir key, so it has to be bumped whenever the generated bytes change for the same input
+#define CACHE_KEY_VERSION 4
+#define MAX_PHASES 64
 
 // The array element specifies the location and size of a segment
 // which may be made read-only after relocations have been processed
 // From https://refspecs.linuxfoundation.org/LSB_5.0.0/LSB-Core-generic/LSB-Core-generic/progheader.html
 #define PT_GNU_RELRO 0x6474e552
 
-#define EH_FRAME_SECTION_HEADER_INDEX 4
-#define SYMTAB_SECTION_HEADER_INDEX 7
-#define STRTAB_SECTION_HEADER_INDEX 9
+// ld always reserves this many extra DT_NULL entries at the end of .dynamic
+#define DYNAMIC_SPARE_ENTRIES 6
+
+// The number of `dq <label>` operands
+#define MAX_RELOCATIONS 1048576
+
+// Every bitmap entry of .relr.dyn covers the next 63 words
+// See https://maskray.me/blog/2021-10-31-relative-relocations-and-relr
+#define RELR_BITMAP_BITS 63
+
+// The log2 of the number of bits in a .gnu.hash bloom filter word on 64-bit
+#define GNU_HASH_SHIFT1 6
 
 // From "st_info" its description here:
 // https://docs.oracle.com/cd/E19683-01/816-1386/chapter6-79797/index.html
@@ -35,8 +105,27 @@ enum d_type {
     DT_HASH = 4, // The address of the symbol hash table. This table refers to the symbol table indicated by the DT_SYMTAB element
     DT_STRTAB = 5, // The address of the string table
     DT_SYMTAB = 6, // The address of the symbol table
+    DT_RELA = 7, // The address of the relocation table with addends
+    DT_RELASZ = 8, // The total size, in bytes, of the DT_RELA relocation table
+    DT_RELAENT = 9, // The size, in bytes, of the DT_RELA relocation entry
     DT_STRSZ = 10, // The total size, in bytes, of the DT_STRTAB string table
     DT_SYMENT = 11, // The size, in bytes, of the DT_SYMTAB symbol entry
+    DT_SYMBOLIC = 16, // The dynamic linker looks up symbols in this object first
+    DT_FLAGS = 30, // Flag values specific to this object
+    DT_RELRSZ = 35, // The total size, in bytes, of the DT_RELR relocation table
+    DT_RELR = 36, // The address of the packed relative relocation table
+    DT_RELRENT = 37, // The size, in bytes, of the DT_RELR relocation entry
+    DT_GNU_HASH = 0x6ffffef5, // The address of the GNU symbol hash table
+    DT_RELACOUNT = 0x6ffffff9, // The number of R_X86_64_RELATIVE relocations at the start of DT_RELA
+};
+
+enum d_flags {
+    DF_SYMBOLIC = 2, // Same as DT_SYMBOLIC
+};
+
+enum r_type {
+    R_X86_64_64 = 1, // The address of the symbol plus the addend
+    R_X86_64_RELATIVE = 8, // The load address of the object plus the addend
 };
 
 enum p_type {
@@ -54,9 +143,13 @@ enum sh_type {
     SHT_PROGBITS = 0x1, // Program data
     SHT_SYMTAB = 0x2, // Symbol table
     SHT_STRTAB = 0x3, // String table
+    SHT_RELA = 0x4, // Relocation entries with addends
     SHT_HASH = 0x5, // Symbol hash table
     SHT_DYNAMIC = 0x6, // Dynamic linking information
+    SHT_NOBITS = 0x8, // Occupies no space in the file
     SHT_DYNSYM = 0xb, // Dynamic linker symbol table
+    SHT_RELR = 0x13, // Packed relative relocation entries
+    SHT_GNU_HASH = 0x6ffffff6, // GNU symbol hash table
 };
 
 enum sh_flags {
@@ -89,122 +182,724 @@ typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
+typedef int64_t i64;
+
+enum hash_style {
+    HASH_STYLE_SYSV = 1, // Emit .hash
+    HASH_STYLE_GNU = 2, // Emit .gnu.hash
+    HASH_STYLE_BOTH = HASH_STYLE_SYSV | HASH_STYLE_GNU,
+};
+
+enum output_backend {
+    OUTPUT_BACKEND_BUFFER, // Build the image in a heap buffer, and fwrite() it at the end
+    OUTPUT_BACKEND_MMAP, // Build the image directly in a shared mapping of the output file
+    OUTPUT_BACKEND_MEMFD, // Build the image directly in a shared mapping of a memfd_create() file, which never touches the disk
+};
+
+enum stats_format {
+    STATS_FORMAT_NONE,
+    STATS_FORMAT_TEXT, // A table for humans
+    STATS_FORMAT_JSON, // One JSON object per generated shared object
+};
+
+enum section {
+    SECTION_TEXT, // NASM assembles into .text until the first `section` directive
+    SECTION_DATA,
+    SECTION_RODATA,
+    SECTION_BSS,
+};
+
+// All of the state of generating one shared object, so that every thread can generate its own
+// The functions find it through the thread-local ctx pointer, instead of it being passed around
+struct context {
+    enum hash_style hash_style;
+    enum output_backend output_backend;
+
+    char *source_path;
+    size_t source_path_length;
+
+    char *output_path;
+
+    enum stats_format stats_format;
+
+    bool optimize_hash_buckets; // -O1
+
+    bool is_symbolic; // -Bsymbolic
+    bool pack_relative_relocs; // -z pack-relative-relocs
+    bool separate_code; // -z separate-code, which is the default
+    bool relro; // -z relro, which is the default
+    size_t max_page_size; // -z max-page-size=
+    bool pad_text_segment; // --huge-page-text
+    bool incremental; // --incremental
+    bool skip_unchanged; // --skip-unchanged
+    char *cache_dir; // --cache-dir=
+    bool strip_all; // -s, --strip-all
+    bool split_debug; // --split-debug
+    char *profile_path; // --profile=
+    size_t function_alignment; // --align-functions=
+
+    // The output file, while OUTPUT_BACKEND_MMAP or OUTPUT_BACKEND_MEMFD has it mapped
+    int output_fd;
+
+    // Set while the <output>.debug file of --split-debug is being pushed, instead of the output
+    bool is_debug_image;
+
+    // The symbol table, as a struct of arrays indexed by the order in which the labels were defined
+    // Every array is only as wide as it has to be, since the passes over it are bound by memory
+    // The names point into the mapped source file, so they aren't null-terminated
+    char *symbols[MAX_SYMBOLS];
+    size_t symbols_size;
+
+    u32 symbol_name_lengths[MAX_SYMBOLS];
+
+    enum section symbol_sections[MAX_SYMBOLS];
+    u32 symbol_section_offsets[MAX_SYMBOLS]; // The offset of the label in .data or .text
+    u32 symbol_values[MAX_SYMBOLS]; // The virtual address, once the layout is known
+    u16 symbol_section_indices[MAX_SYMBOLS];
+    u64 symbol_sample_counts[MAX_SYMBOLS]; // How hot the --profile says the label is
+    u16 symbol_alignments[MAX_SYMBOLS]; // What the `align` right before a label of .text asked for, and 1 otherwise
+    u16 symbol_paddings[MAX_SYMBOLS]; // How many NOPs that `align` put in front of the label
+
+    bool is_substrs[MAX_SYMBOLS];
+    u32 parent_indices[MAX_SYMBOLS];
+
+    u32 symbol_name_dynstr_offsets[MAX_SYMBOLS];
+    u32 symbol_name_strtab_offsets[MAX_SYMBOLS];
+
+    u32 buckets[MAX_OPTIMIZED_HASH_BUCKETS];
+    u32 hash_nbucket;
+
+    u32 chains[MAX_SYMBOLS + 1]; // The first entry is always STN_UNDEF
+    size_t chains_size;
+
+    u32 shuffled_symbol_index_to_symbol_index[MAX_SYMBOLS];
+    size_t shuffled_symbols_size;
+
+    // .dynsym is in shuffled order, unless .gnu.hash requires it to be sorted by bucket
+    u32 dynsym_index_to_symbol_index[MAX_SYMBOLS];
+    u32 symbol_index_to_dynsym_index[MAX_SYMBOLS];
+
+    u32 gnu_hash_counts[MAX_OPTIMIZED_HASH_BUCKETS];
+
+    char *section_names[MAX_SECTION_NAMES];
+    size_t section_names_size;
+
+    u8 *bytes;
+    size_t bytes_size;
+    size_t bytes_capacity;
+
+    // The assembled contents of .data, .rodata and .text
+    u8 *data_bytes;
+    size_t data_capacity;
+    u8 *rodata_bytes;
+    size_t rodata_capacity;
+    u8 *text_bytes;
+    size_t text_capacity;
+
+    // .bss only takes up memory, so only its size is tracked
+    size_t bss_size;
+
+    // ld leaves out .data, .rodata and .bss when they are empty, unless a label is defined in them
+    bool has_data_labels;
+    bool has_rodata_labels;
+    bool has_bss_labels;
+
+    size_t text_offset;
+    size_t text_size;
+    size_t rodata_offset;
+    size_t rodata_size;
+    size_t eh_frame_offset;
+    size_t data_offset;
+    size_t data_size;
+    size_t hash_offset;
+    size_t hash_size;
+    size_t gnu_hash_offset;
+    size_t gnu_hash_size;
+    u32 gnu_hash_nbucket;
+    size_t dynsym_offset;
+    size_t dynsym_size;
+    size_t dynstr_offset;
+    size_t dynstr_size;
+    size_t rela_dyn_offset;
+    size_t rela_dyn_size;
+    size_t relr_dyn_offset;
+    size_t relr_dyn_size;
+    size_t segment_0_size;
+    size_t text_segment_size;
+    size_t symtab_offset;
+    size_t symtab_size;
+    size_t strtab_offset;
+    size_t strtab_size;
+    size_t strtab_local_names_size; // The bytes before the global symbol names: "\0full.s\0_DYNAMIC\0"
+    size_t shstrtab_offset;
+    size_t shstrtab_size;
+    size_t gnu_debuglink_offset;
+    size_t gnu_debuglink_size;
+    size_t section_headers_offset;
+    size_t dynamic_offset;
+    size_t dynamic_size;
+    size_t program_header_count;
+
+    // How much room --incremental reserved for every section to grow into, which is more than what they hold
+    size_t reserved_symbols_size;
+    size_t dynstr_reserved_size;
+    size_t text_reserved_size;
+    size_t rodata_reserved_size;
+    size_t data_reserved_size;
+    size_t strtab_reserved_size;
+
+    // The writable segment is only at the same virtual address as its file offset with `-z separate-code`
+    size_t dynamic_address;
+    size_t data_address;
+    size_t bss_address;
+    size_t bss_offset; // Where .data ends in the file, since .bss has no bytes there
+
+    u32 hash_name_offset;
+    u32 gnu_hash_name_offset;
+    u32 dynsym_name_offset;
+    u32 dynstr_name_offset;
+    u32 rela_dyn_name_offset;
+    u32 relr_dyn_name_offset;
+    u32 text_name_offset;
+    u32 rodata_name_offset;
+    u32 eh_frame_name_offset;
+    u32 dynamic_name_offset;
+    u32 data_name_offset;
+    u32 bss_name_offset;
+    u32 symtab_name_offset;
+    u32 strtab_name_offset;
+    u32 shstrtab_name_offset;
+    u32 gnu_debuglink_name_offset;
+
+    u16 hash_section_index;
+    u16 gnu_hash_section_index;
+    u16 dynsym_section_index;
+    u16 dynstr_section_index;
+    u16 rela_dyn_section_index;
+    u16 relr_dyn_section_index;
+    u16 text_section_index;
+    u16 rodata_section_index;
+    u16 eh_frame_section_index;
+    u16 dynamic_section_index;
+    u16 data_section_index;
+    u16 bss_section_index;
+    u16 symtab_section_index;
+    u16 strtab_section_index;
+    u16 shstrtab_section_index;
+    u16 gnu_debuglink_section_index;
+    u16 section_count;
+
+    // What end_phase() measured, when --stats is passed
+    char *phase_names[MAX_PHASES];
+    double phase_seconds[MAX_PHASES];
+    size_t phase_bytes[MAX_PHASES];
+    long phase_peak_rss_kib[MAX_PHASES];
+    size_t phases_size;
+    double phase_start_seconds;
+    size_t phase_start_bytes;
+
+    // Scratch space of the init and push functions
+    u64 gnu_hash_bloom[MAX_SYMBOLS];
+    u32 sorted_symbol_indices[MAX_SYMBOLS];
+    u32 bfd_hash_table_a[MAX_BFD_HASH_SIZE];
+    u32 bfd_hash_table_b[MAX_BFD_HASH_SIZE];
+
+    // Every hash of every symbol name, computed once by hash_symbols()
+    u32 symbol_elf_hashes[MAX_SYMBOLS];
+    u32 symbol_gnu_hashes[MAX_SYMBOLS];
+    unsigned long symbol_bfd_hashes[MAX_SYMBOLS];
+    long hash_thread_count; // 1 in batch mode, since the batch already keeps every core busy
+
+    // Every `dq <label>` in .data, in the order of their offsets
+    char *relocation_names[MAX_RELOCATIONS]; // Points into the mapped source file
+    u32 relocation_name_lengths[MAX_RELOCATIONS];
+    u32 relocation_section_offsets[MAX_RELOCATIONS]; // The offset of the operand in .data
+    u32 relocation_symbol_indices[MAX_RELOCATIONS];
+    size_t relocations_size;
+
+    // The relocations that end up in .rela.dyn, in the order ld sorts them in
+    u32 rela_relocation_indices[MAX_RELOCATIONS];
+    size_t rela_relocations_size;
+    size_t relative_rela_relocations_size; // The R_X86_64_RELATIVE ones, which ld puts first
+
+    // The .relr.dyn entries, where the addresses are still relative to .data
+    u64 relr_entries[MAX_RELOCATIONS];
+    size_t relr_entries_size;
+
+    u32 symbol_first_relocation_offsets[MAX_SYMBOLS];
+
+    // How many buckets have a chain of every length, for --stats
+    // They are only computed when the image gets built, so not when the output was patched or restored from the cache
+    bool has_chain_length_counts;
+    u32 hash_chain_length_counts[MAX_SYMBOLS + 1];
+    size_t hash_chain_length_counts_size;
+    u32 gnu_hash_chain_length_counts[MAX_SYMBOLS + 1];
+    size_t gnu_hash_chain_length_counts_size;
+
+    // The source is tokenized straight out of its mapping, in a single pass
+    // Only the subset of NASM that full.s uses is supported:
+    // `global`, `section .data`, `section .rodata`, `section .bss` and `section .text`, labels, `db`/`dw`/`dd`/`dq`,
+    // `resb`/`resw`/`resd`/`resq`, `dq label`, `mov reg64, imm`, `ret` and `align` in .text
+    char *source;
+    size_t source_size;
+    char *cursor;
+    char *source_end;
+    size_t line_number;
+
+    enum section current_section;
+
+    // The `align` directives that the last bytes of .text were padded by, so the label after them can remember it
+    size_t last_text_alignment;
+    size_t last_text_alignment_start;
+    size_t last_text_alignment_offset;
+
+    // The biggest alignment that .text got padded to, which ld uses as the alignment of the whole section
+    size_t text_alignment;
+
+    // The names that `global` declared, which point into the mapped source file
+    char *global_names[MAX_SYMBOLS];
+    size_t global_name_lengths[MAX_SYMBOLS];
+    bool is_global_defined[MAX_SYMBOLS];
+    u32 global_symbol_indices[MAX_SYMBOLS]; // Only valid once the global is defined
+    size_t globals_size;
+
+    // Open addressing with linear probing, where every slot is an index into global_names plus one, or 0 when empty
+    u32 globals_table[GLOBALS_TABLE_SIZE];
+};
+
+// What --incremental saves next to the output as <output>.layout,
+// so that the next run can find the sections in the output, and knows how much room they have left to grow
+struct saved_layout {
+    u64 magic;
+
+    // Identifies the output this was saved for, so that it isn't applied to an output that was overwritten since
+    u64 output_inode;
+    u64 output_size;
+    struct timespec output_mtime;
+
+    // The options that change what the output looks like
+    enum hash_style hash_style;
+    bool is_symbolic;
+    bool pack_relative_relocs;
+    bool separate_code;
+    bool relro;
+    bool pad_text_segment;
+    size_t max_page_size;
+
+    size_t symbols_size;
+    size_t reserved_symbols_size;
+    u32 hash_nbucket;
+    bool has_relocations;
+
+    size_t hash_offset;
+    size_t dynsym_offset;
+    size_t dynstr_offset;
+    size_t dynstr_size;
+    size_t dynstr_reserved_size;
+    size_t rela_dyn_offset;
+    size_t rela_dyn_size;
+    size_t relr_dyn_offset;
+    size_t relr_dyn_size;
+    bool has_text;
+    size_t text_offset;
+    size_t text_size;
+    size_t text_reserved_size;
+    bool has_rodata;
+    size_t rodata_offset;
+    size_t rodata_size;
+    size_t rodata_reserved_size;
+    size_t eh_frame_offset;
+    size_t dynamic_offset;
+    size_t dynamic_size;
+    bool has_data;
+    size_t data_offset;
+    size_t data_address;
+    size_t data_size;
+    size_t data_reserved_size;
+    bool has_bss;
+    size_t bss_address;
+    size_t symtab_offset;
+    size_t strtab_offset;
+    size_t strtab_size;
+    size_t strtab_reserved_size;
+    size_t section_headers_offset;
+
+    u16 hash_section_index;
+    u16 dynsym_section_index;
+    u16 dynstr_section_index;
+    u16 text_section_index;
+    u16 rodata_section_index;
+    u16 data_section_index;
+    u16 bss_section_index;
+    u16 symtab_section_index;
+    u16 strtab_section_index;
+};
+
+static _Thread_local struct context *ctx;
 
-static char *symbols[MAX_SYMBOLS];
-static size_t symbols_size;
+// The source and output path of every job of --batch
+static char *job_source_paths[MAX_JOBS];
+static char *job_output_paths[MAX_JOBS];
+static size_t jobs_size;
 
-static bool is_substrs[MAX_SYMBOLS];
+static atomic_size_t next_job_index;
+
+static char *batch_path;
+static long thread_count;
+
+// The context is too big for the stack, and calloc() lets the kernel hand out its zeroed pages lazily
+static struct context *create_context(void) {
+    struct context *new_ctx = calloc(1, sizeof(struct context));
+    if (!new_ctx) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
 
-static size_t symbol_name_dynstr_offsets[MAX_SYMBOLS];
-static size_t symbol_name_strtab_offsets[MAX_SYMBOLS];
+    new_ctx->hash_style = HASH_STYLE_SYSV;
+    new_ctx->output_backend = OUTPUT_BACKEND_BUFFER;
+    new_ctx->source_path = "full.s";
+    new_ctx->output_path = "full.so";
+    new_ctx->output_fd = -1;
+    new_ctx->hash_thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    new_ctx->separate_code = true;
+    new_ctx->relro = true;
+    new_ctx->max_page_size = PAGE_SIZE;
+    new_ctx->function_alignment = 1;
+
+    return new_ctx;
+}
 
-static u32 buckets[MAX_HASH_BUCKETS];
+static void destroy_context(struct context *old_ctx) {
+    // The image of the mmap and memfd backends has already been unmapped by then
+    if (old_ctx->output_fd == -1) {
+        free(old_ctx->bytes);
+    }
+    free(old_ctx->data_bytes);
+    free(old_ctx->rodata_bytes);
+    free(old_ctx->text_bytes);
+    free(old_ctx);
+}
 
-static u32 chains[MAX_SYMBOLS];
-static size_t chains_size;
+static double get_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-static char *shuffled_symbols[MAX_SYMBOLS];
-static size_t shuffled_symbols_size;
+static void begin_phase(void) {
+    if (ctx->stats_format == STATS_FORMAT_NONE) {
+        return;
+    }
 
-static size_t shuffled_symbol_index_to_symbol_index[MAX_SYMBOLS];
+    ctx->phase_start_seconds = get_seconds();
+    ctx->phase_start_bytes = ctx->bytes_size;
+}
 
-static size_t data_offsets[MAX_SYMBOLS];
-static size_t text_offsets[MAX_SYMBOLS];
+// Records the wall time and the number of pushed bytes since begin_phase(),
+// and the high-water mark of the memory of the process
+static void end_phase(char *name) {
+    if (ctx->stats_format == STATS_FORMAT_NONE) {
+        return;
+    }
 
-static u8 bytes[MAX_BYTES];
-static size_t bytes_size;
+    if (ctx->phases_size + 1 > MAX_PHASES) {
+        fprintf(stderr, "error: MAX_PHASES of %d was exceeded\n", MAX_PHASES);
+        exit(EXIT_FAILURE);
+    }
 
-static size_t text_size;
-static size_t data_size;
-static size_t hash_offset;
-static size_t hash_size;
-static size_t dynsym_offset;
-static size_t dynsym_size;
-static size_t dynstr_offset;
-static size_t dynstr_size;
-static size_t segment_0_size;
-static size_t symtab_offset;
-static size_t symtab_size;
-static size_t strtab_offset;
-static size_t strtab_size;
-static size_t shstrtab_offset;
-static size_t shstrtab_size;
-static size_t section_headers_offset;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
 
-static void overwrite_address(u64 n, size_t bytes_offset) {
-    for (size_t i = 0; i < 8; i++) {
-        // Little-endian requires the least significant byte first
-        bytes[bytes_offset++] = n & 0xff;
+    ctx->phase_names[ctx->phases_size] = name;
+    ctx->phase_seconds[ctx->phases_size] = get_seconds() - ctx->phase_start_seconds;
+    ctx->phase_bytes[ctx->phases_size] = ctx->bytes_size - ctx->phase_start_bytes;
+    ctx->phase_peak_rss_kib[ctx->phases_size] = usage.ru_maxrss;
+    ctx->phases_size++;
+}
 
-        n >>= 8; // Shift right by one byte
+// Host processes don't have to create the context of their threads themselves
+static void init_thread_context(void) {
+    if (!ctx) {
+        ctx = create_context();
     }
 }
 
-static void fix_bytes() {
-    // ELF section header table offset
-    overwrite_address(section_headers_offset, 0x28);
+// Grows the output file, so that the kernel writes the pushed bytes back to it
+// without them ever being copied into a separate buffer
+static void reserve_mapped_bytes(size_t new_capacity) {
+    if (ftruncate(ctx->output_fd, new_capacity) == -1) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
 
-    // Segment 0 its file_size
-    overwrite_address(segment_0_size, 0x60);
+    u8 *new_bytes;
+    if (ctx->bytes_capacity == 0) {
+        new_bytes = mmap(NULL, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->output_fd, 0);
+    } else {
+        new_bytes = mremap(ctx->bytes, ctx->bytes_capacity, new_capacity, MREMAP_MAYMOVE);
+    }
+    if (new_bytes == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
 
-    // Segment 0 its mem_size
-    overwrite_address(segment_0_size, 0x68);
+    ctx->bytes = new_bytes;
+    ctx->bytes_capacity = new_capacity;
 }
 
-static void push_byte(u8 byte) {
-    if (bytes_size + 1 > MAX_BYTES) {
-        fprintf(stderr, "error: MAX_BYTES of %d was exceeded\n", MAX_BYTES);
+// Makes sure at least `capacity` bytes fit, doubling the capacity so that pushing stays amortized O(1)
+static void reserve_bytes(size_t capacity) {
+    if (capacity <= ctx->bytes_capacity) {
+        return;
+    }
+
+    size_t new_capacity = ctx->bytes_capacity > 0 ? ctx->bytes_capacity : MIN_BYTES_CAPACITY;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+
+    if (ctx->output_fd != -1) {
+        reserve_mapped_bytes(new_capacity);
+        return;
+    }
+
+    u8 *new_bytes = realloc(ctx->bytes, new_capacity);
+    if (!new_bytes) {
+        perror("realloc");
         exit(EXIT_FAILURE);
     }
 
-    bytes[bytes_size++] = byte;
+    ctx->bytes = new_bytes;
+    ctx->bytes_capacity = new_capacity;
+}
+
+// Appends `count` uninitialized bytes, and returns a pointer to the first one
+static u8 *grow_bytes(size_t count) {
+    reserve_bytes(ctx->bytes_size + count);
+
+    u8 *start = ctx->bytes + ctx->bytes_size;
+    ctx->bytes_size += count;
+    return start;
+}
+
+static void push_span(const void *span, size_t count) {
+    memcpy(grow_bytes(count), span, count);
+}
+
+static void push_byte(u8 byte) {
+    *grow_bytes(1) = byte;
 }
 
 static void push_zeros(size_t count) {
-    for (size_t i = 0; i < count; i++) {
-        push_byte(0);
+    memset(grow_bytes(count), 0, count);
+}
+
+// Little-endian requires the least significant byte first
+static void store_u16(u8 *dest, u16 n) {
+    dest[0] = n;
+    dest[1] = n >> 8;
+}
+
+static void store_u32(u8 *dest, u32 n) {
+    dest[0] = n;
+    dest[1] = n >> 8;
+    dest[2] = n >> 16;
+    dest[3] = n >> 24;
+}
+
+static void store_u64(u8 *dest, u64 n) {
+    store_u32(dest, n);
+    store_u32(dest + 4, n >> 32);
+}
+
+static u32 load_u32(const u8 *src) {
+    return src[0] | src[1] << 8 | src[2] << 16 | (u32)src[3] << 24;
+}
+
+static u64 load_u64(const u8 *src) {
+    return load_u32(src) | (u64)load_u32(src + 4) << 32;
+}
+
+// Fills the padding with the fewest instructions, in the same way as the .p2align of GNU as does in code,
+// which jumps over the padding once it would take 8 or more of the longest NOPs
+// See i386_generate_nops() in https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=gas/config/tc-i386.c
+static void store_nops(u8 *dest, size_t count) {
+    static const u8 nops[][11] = {
+        {0x90}, // nop
+        {0x66, 0x90}, // xchg ax, ax
+        {0x0f, 0x1f, 0x00}, // nop DWORD PTR [rax]
+        {0x0f, 0x1f, 0x40, 0x00}, // nop DWORD PTR [rax+0x0]
+        {0x0f, 0x1f, 0x44, 0x00, 0x00}, // nop DWORD PTR [rax+rax*1+0x0]
+        {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00}, // nop WORD PTR [rax+rax*1+0x0]
+        {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00}, // nop DWORD PTR [rax+0x0]
+        {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00}, // nop DWORD PTR [rax+rax*1+0x0]
+        {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00}, // nop WORD PTR [rax+rax*1+0x0]
+        {0x66, 0x2e, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00}, // cs nop WORD PTR [rax+rax*1+0x0]
+        {0x66, 0x66, 0x2e, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00}, // data16 cs nop WORD PTR [rax+rax*1+0x0]
+    };
+    size_t max_nop_size = sizeof(nops) / sizeof(*nops);
+
+    if (count >= 8 * max_nop_size) {
+        if (count - 2 <= INT8_MAX) {
+            // jmp rel8
+            dest[0] = 0xeb;
+            dest[1] = count - 2;
+            dest += 2;
+            count -= 2;
+        } else {
+            // jmp rel32
+            dest[0] = 0xe9;
+            store_u32(dest + 1, count - 5);
+            dest += 5;
+            count -= 5;
+        }
+    }
+
+    for (; count >= max_nop_size; count -= max_nop_size) {
+        memcpy(dest, nops[max_nop_size - 1], max_nop_size);
+        dest += max_nop_size;
+    }
+    if (count > 0) {
+        memcpy(dest, nops[count - 1], count);
     }
 }
 
-static void push_alignment(size_t alignment) {
-    size_t excess = bytes_size % alignment;
-    if (excess > 0) {
-        push_zeros(alignment - excess);
+static void push_u16(u16 n) {
+    store_u16(grow_bytes(2), n);
+}
+
+static void push_u32(u32 n) {
+    store_u32(grow_bytes(4), n);
+}
+
+static void push_u64(u64 n) {
+    store_u64(grow_bytes(8), n);
+}
+
+// Pads with zeros up to the offset that init_layout() gave the next section
+static void push_padding(size_t offset) {
+    if (ctx->bytes_size > offset) {
+        fprintf(stderr, "error: The pushed bytes overlap the section at offset 0x%zx\n", offset);
+        exit(EXIT_FAILURE);
     }
+
+    push_zeros(offset - ctx->bytes_size);
 }
 
 static void push_string(char *str) {
-    for (size_t i = 0; i < strlen(str); i++) {
-        push_byte(str[i]);
+    push_span(str, strlen(str) + 1);
+}
+
+// Symbol names aren't null-terminated in the source, so the '\0' is pushed separately
+static void push_symbol_name(size_t symbol_index) {
+    push_span(ctx->symbols[symbol_index], ctx->symbol_name_lengths[symbol_index]);
+    push_byte(0);
+}
+
+static size_t align_up(size_t n, size_t alignment) {
+    return (n + alignment - 1) & ~(alignment - 1);
+}
+
+// ld leaves out an empty .text, even when there are labels in it
+static bool has_text(void) {
+    return ctx->text_size > 0;
+}
+
+static bool has_data(void) {
+    return ctx->data_size > 0 || ctx->has_data_labels;
+}
+
+static bool has_rodata(void) {
+    return ctx->rodata_size > 0 || ctx->has_rodata_labels;
+}
+
+static bool has_bss(void) {
+    return ctx->bss_size > 0 || ctx->has_bss_labels;
+}
+
+// The code only gets a segment of its own with `-z separate-code`, and only when there is code
+static bool has_text_segment(void) {
+    return ctx->separate_code && has_text();
+}
+
+// Without a .text segment in between, ld merges the read-only data into the first segment,
+// but after one it always emits a segment for .eh_frame, even when there is no .rodata and .eh_frame is empty
+static bool has_rodata_segment(void) {
+    return has_text_segment();
+}
+
+// The writable segment comes after the first one, and the .text and .rodata segments when they are there
+static size_t get_data_segment_index(void) {
+    return 1 + has_text_segment() + has_rodata_segment();
+}
+
+// ld its linker script pads .bss until its end is 8-byte aligned
+static size_t get_bss_section_size(size_t bss_address) {
+    return align_up(bss_address + ctx->bss_size, 8) - bss_address;
+}
+
+// The output only has a .symtab with neither --strip-all nor --split-debug, while the debug file always has one
+static bool has_symtab(void) {
+    return !ctx->strip_all || ctx->is_debug_image;
+}
+
+static bool has_gnu_debuglink(void) {
+    return ctx->split_debug && !ctx->is_debug_image;
+}
+
+static void get_debug_path(char *path, size_t path_size) {
+    if ((size_t)snprintf(path, path_size, "%s.debug", ctx->output_path) >= path_size) {
+        fprintf(stderr, "error: The output path '%s' is too long\n", ctx->output_path);
+        exit(EXIT_FAILURE);
     }
-    push_byte('\0');
 }
 
-static void push_shstrtab(void) {
-    shstrtab_offset = bytes_size;
+static char *get_basename(char *path) {
+    char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
 
-    push_byte(0);
-    push_string(".symtab");
-    push_string(".strtab");
-    push_string(".shstrtab");
-    push_string(".hash");
-    push_string(".dynsym");
-    push_string(".dynstr");
-    push_string(".text");
-    push_string(".eh_frame");
-    push_string(".dynamic");
-    push_string(".data");
+// The CRC-32 of zlib, which gdb compares with the one in .gnu_debuglink before using the debug file
+// See https://sourceware.org/gdb/current/onlinedocs/gdb.html/Separate-Debug-Files.html
+static u32 get_crc32(u8 *bytes, size_t size) {
+    u32 table[256];
+    for (u32 i = 0; i < 256; i++) {
+        u32 c = i;
+        for (size_t bit = 0; bit < 8; bit++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+
+    u32 crc = 0xffffffff;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
 
-    shstrtab_size = bytes_size - shstrtab_offset;
+// The CRC-32 of the debug file is stored by write_debug_file(), once that file has been pushed
+static void push_gnu_debuglink(void) {
+    char debug_path[4096];
+    get_debug_path(debug_path, sizeof(debug_path));
 
-    push_alignment(8);
+    size_t start = ctx->bytes_size;
+    push_string(get_basename(debug_path));
+    push_padding(start + ctx->gnu_debuglink_size - 4);
+    push_u32(0);
 }
 
-static void push_strtab(void) {
-    strtab_offset = bytes_size;
+static void push_shstrtab(void) {
+    push_byte(0);
+
+    for (size_t i = 0; i < ctx->section_names_size; i++) {
+        push_string(ctx->section_names[i]);
+    }
+}
 
+static void push_strtab(void) {
     push_byte(0);
-    push_string("full.s");
+    push_string(ctx->source_path);
     
     // Local symbols
     // TODO: Add loop
@@ -213,53 +908,36 @@ static void push_strtab(void) {
 
     // Global symbols
     // TODO: Don't loop through local symbols
-    for (size_t i = 0; i < symbols_size; i++) {
-        size_t symbol_index = shuffled_symbol_index_to_symbol_index[i];
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        size_t symbol_index = ctx->shuffled_symbol_index_to_symbol_index[i];
 
-        if (!is_substrs[symbol_index]) {
-            push_string(shuffled_symbols[i]);
+        if (!ctx->is_substrs[symbol_index]) {
+            push_symbol_name(symbol_index);
         }
     }
-
-    strtab_size = bytes_size - strtab_offset;
-}
-
-static void push_number(u64 n, size_t byte_count) {
-    while (n > 0) {
-        // Little-endian requires the least significant byte first
-        push_byte(n & 0xff);
-        byte_count--;
-
-        n >>= 8; // Shift right by one byte
-    }
-
-    // Optional padding
-    push_zeros(byte_count);
 }
 
 // See https://docs.oracle.com/cd/E19683-01/816-1386/chapter6-79797/index.html
 // See https://docs.oracle.com/cd/E19683-01/816-1386/6m7qcoblj/index.html#chapter6-tbl-21
 static void push_symbol_entry(u32 name, u16 info, u16 shndx, u32 offset) {
-    push_number(name, 4); // Indexed into .strtab, because .symtab its "link" points to it
-    push_number(info, 2);
-    push_number(shndx, 2);
-    push_number(offset, 4); // In executable and shared object files, st_value holds a virtual address
+    push_u32(name); // Indexed into .strtab, because .symtab its "link" points to it
+    push_u16(info);
+    push_u16(shndx);
+    push_u32(offset); // In executable and shared object files, st_value holds a virtual address
 
     // TODO: I'm confused by why we don't seem to need these
-    // push_number(size, 4);
-    // push_number(other, 4);
+    // push_u32(size);
+    // push_u32(other);
 
     push_zeros(SYMTAB_ENTRY_SIZE - 12);
 }
 
 static void push_symtab(void) {
-    symtab_offset = bytes_size;
-
     // Null entry
     // 0x3020 to 0x3038
     push_symbol_entry(0, ELF32_ST_INFO(STB_LOCAL, STT_NOTYPE), SHN_UNDEF, 0);
 
-    // "full.s" entry
+    // Source file entry
     // 0x3038 to 0x3050
     push_symbol_entry(1, ELF32_ST_INFO(STB_LOCAL, STT_FILE), SHN_ABS, 0);
 
@@ -269,97 +947,138 @@ static void push_symtab(void) {
 
     // "_DYNAMIC" entry
     // 0x3068 to 0x3080
-    push_symbol_entry(8, ELF32_ST_INFO(STB_LOCAL, STT_OBJECT), 6, DYNAMIC_OFFSET);
+    push_symbol_entry(ctx->source_path_length + 2, ELF32_ST_INFO(STB_LOCAL, STT_OBJECT), ctx->dynamic_section_index, ctx->dynamic_address);
 
-    // The symbols are pushed in shuffled_symbols order
-    for (size_t i = 0; i < symbols_size; i++) {
-        size_t symbol_index = shuffled_symbol_index_to_symbol_index[i];
+    // The symbols are pushed in shuffled order
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        size_t symbol_index = ctx->shuffled_symbol_index_to_symbol_index[i];
 
-        bool is_data = symbol_index < 9; // TODO: Use the data symbol count from the AST
-        u16 shndx = is_data ? SYMTAB_SECTION_HEADER_INDEX : EH_FRAME_SECTION_HEADER_INDEX;
-        u32 offset = is_data ? DATA_OFFSET + data_offsets[symbol_index] : TEXT_OFFSET + text_offsets[symbol_index - 9]; // TODO: Use the data symbol count from the AST
-
-        // The starting offset of 16 is from "full.s" + "_DYNAMIC"
-        push_symbol_entry(16 + symbol_name_strtab_offsets[symbol_index], ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), shndx, offset);
+        // The names start after the source file and "_DYNAMIC"
+        push_symbol_entry(ctx->strtab_local_names_size + ctx->symbol_name_strtab_offsets[symbol_index], ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), ctx->symbol_section_indices[symbol_index], ctx->symbol_values[symbol_index]);
     }
-
-    symtab_size = bytes_size - symtab_offset;
 }
 
 static void push_data(void) {
-    // TODO: Use the data from the AST
-    
-    // "define" label
-    push_number(1337, 2);
-    push_byte(69);
-
-    push_string("a^");
-    push_string("b^");
-    push_string("c^");
-    push_string("d^");
-    push_string("e^");
-    push_string("f^");
-    push_string("g^");
-    push_string("h^");
+    push_span(ctx->data_bytes, ctx->data_size);
+}
 
-    push_alignment(8);
+static void push_rodata(void) {
+    push_span(ctx->rodata_bytes, ctx->rodata_size);
 }
 
 // See https://docs.oracle.com/cd/E23824_01/html/819-0690/chapter6-42444.html
 static void push_dynamic_entry(u64 tag, u64 value) {
-    push_number(tag, 8);
-    push_number(value, 8);
+    push_u64(tag);
+    push_u64(value);
+}
+
+// ld reserves the entries before it knows which relocations can be packed into .relr.dyn,
+// so DT_RELA stays reserved when all of them got packed, and DT_RELR when none of them did
+// DT_RELACOUNT isn't reserved, since ld writes it into one of the spare entries
+static size_t get_dynamic_entry_count(void) {
+    size_t count = 4; // DT_STRTAB, DT_SYMTAB, DT_STRSZ and DT_SYMENT
+
+    if (ctx->hash_style & HASH_STYLE_SYSV) {
+        count++;
+    }
+    if (ctx->hash_style & HASH_STYLE_GNU) {
+        count++;
+    }
+    if (ctx->relocations_size > 0) {
+        count += 3; // DT_RELA, DT_RELASZ and DT_RELAENT
+    }
+    if (ctx->is_symbolic) {
+        count += 2; // DT_SYMBOLIC and DT_FLAGS
+    }
+    if (ctx->pack_relative_relocs) {
+        count += 3; // DT_RELR, DT_RELRSZ and DT_RELRENT
+    }
+
+    return count + DYNAMIC_SPARE_ENTRIES;
 }
 
 static void push_dynamic() {
-    push_dynamic_entry(DT_HASH, hash_offset);
-    push_dynamic_entry(DT_STRTAB, dynstr_offset);
-    push_dynamic_entry(DT_SYMTAB, dynsym_offset);
-    push_dynamic_entry(DT_STRSZ, dynstr_size);
+    size_t start = ctx->bytes_size;
+
+    if (ctx->is_symbolic) {
+        push_dynamic_entry(DT_SYMBOLIC, 0);
+    }
+    if (ctx->hash_style & HASH_STYLE_SYSV) {
+        push_dynamic_entry(DT_HASH, ctx->hash_offset);
+    }
+    if (ctx->hash_style & HASH_STYLE_GNU) {
+        push_dynamic_entry(DT_GNU_HASH, ctx->gnu_hash_offset);
+    }
+    push_dynamic_entry(DT_STRTAB, ctx->dynstr_offset);
+    push_dynamic_entry(DT_SYMTAB, ctx->dynsym_offset);
+    push_dynamic_entry(DT_STRSZ, ctx->dynstr_size);
     push_dynamic_entry(DT_SYMENT, SYMTAB_ENTRY_SIZE);
-    push_dynamic_entry(DT_NULL, 0);
-    push_dynamic_entry(DT_NULL, 0);
-    push_dynamic_entry(DT_NULL, 0);
-    push_dynamic_entry(DT_NULL, 0);
-    push_dynamic_entry(DT_NULL, 0);
-    push_dynamic_entry(DT_NULL, 0);
-}
 
-static void push_text(void) {
-    // TODO: Use the code from the AST
-    push_byte(0xb8);
-    push_byte(0x2a);
-    push_byte(0);
-    push_byte(0);
-    push_byte(0);
-    push_byte(0xc3);
-    push_byte(0xb8);
-    push_byte(0x2a);
-    push_byte(0);
-    push_byte(0);
-    push_byte(0);
-    push_byte(0xc3);
+    if (ctx->relocations_size > 0) {
+        // ld writes an address of 0 when .rela.dyn ended up empty
+        push_dynamic_entry(DT_RELA, ctx->rela_dyn_size > 0 ? ctx->rela_dyn_offset : 0);
+        push_dynamic_entry(DT_RELASZ, ctx->rela_dyn_size);
+        push_dynamic_entry(DT_RELAENT, RELA_ENTRY_SIZE);
+    }
+    if (ctx->is_symbolic) {
+        push_dynamic_entry(DT_FLAGS, DF_SYMBOLIC);
+    }
+    if (ctx->relative_rela_relocations_size > 0) {
+        push_dynamic_entry(DT_RELACOUNT, ctx->relative_rela_relocations_size);
+    }
+    if (ctx->relr_dyn_size > 0) {
+        push_dynamic_entry(DT_RELR, ctx->relr_dyn_offset);
+        push_dynamic_entry(DT_RELRSZ, ctx->relr_dyn_size);
+        push_dynamic_entry(DT_RELRENT, RELR_ENTRY_SIZE);
+    }
 
-    push_alignment(8);
+    while (ctx->bytes_size - start < ctx->dynamic_size) {
+        push_dynamic_entry(DT_NULL, 0);
+    }
 }
 
-static void push_dynstr(void) {
-    dynstr_offset = bytes_size;
+// .rela.dyn: The relocations the dynamic linker applies to .data
+static void push_rela_dyn(void) {
+    for (size_t i = 0; i < ctx->rela_relocations_size; i++) {
+        size_t relocation_index = ctx->rela_relocation_indices[i];
+        size_t symbol_index = ctx->relocation_symbol_indices[relocation_index];
 
-    // .dynstr always starts with a '\0'
-    dynstr_size = 1;
+        push_u64(ctx->data_address + ctx->relocation_section_offsets[relocation_index]); // r_offset
 
-    push_byte(0);
-    for (size_t i = 0; i < symbols_size; i++) {
-        if (!is_substrs[i]) {
-            push_string(symbols[i]);
-            dynstr_size += strlen(symbols[i]) + 1;
+        if (ctx->is_symbolic) {
+            push_u64(R_X86_64_RELATIVE); // r_info
+            push_u64(ctx->symbol_values[symbol_index]); // r_addend
+        } else {
+            // `1 + `, because index 0 is always STN_UNDEF
+            u64 dynsym_index = 1 + ctx->symbol_index_to_dynsym_index[symbol_index];
+            push_u64(dynsym_index << 32 | R_X86_64_64); // r_info
+            push_u64(0); // r_addend
         }
     }
+}
+
+// .relr.dyn: The packed relative relocations, where only the addresses still have to be moved to .data
+static void push_relr_dyn(void) {
+    for (size_t i = 0; i < ctx->relr_entries_size; i++) {
+        u64 entry = ctx->relr_entries[i];
+        bool is_bitmap = entry & 1;
+        push_u64(is_bitmap ? entry : ctx->data_address + entry);
+    }
+}
+
+static void push_text(void) {
+    push_span(ctx->text_bytes, ctx->text_size);
+}
 
-    segment_0_size = bytes_size;
+static void push_dynstr(void) {
+    // .dynstr always starts with a '\0'
+    push_byte(0);
 
-    push_alignment(8);
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        if (!ctx->is_substrs[i]) {
+            push_symbol_name(i);
+        }
+    }
 }
 
 static u32 get_nbucket(void) {
@@ -379,7 +1098,7 @@ static u32 get_nbucket(void) {
     for (size_t i = 0; nbucket_options[i] != 0; i++) {
         nbucket = nbucket_options[i];
 
-        if (symbols_size < nbucket_options[i + 1]) {
+        if (ctx->symbols_size < nbucket_options[i + 1]) {
             break;
         }
     }
@@ -388,11 +1107,14 @@ static u32 get_nbucket(void) {
 }
 
 // From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elf.c#l193
-static u32 elf_hash(const char *namearg) {
+//
+// Takes a length, since the symbol names aren't null-terminated
+static u32 elf_hash(const char *namearg, size_t len) {
     u32 h = 0;
 
-    for (const unsigned char *name = (const unsigned char *) namearg; *name; name++) {
-        h = (h << 4) + *name;
+    const unsigned char *name = (const unsigned char *) namearg;
+    for (size_t i = 0; i < len; i++) {
+        h = (h << 4) + name[i];
         h ^= (h >> 24) & 0xf0;
     }
 
@@ -400,12 +1122,12 @@ static u32 elf_hash(const char *namearg) {
 }
 
 static void push_chain(u32 chain) {
-    if (chains_size + 1 > MAX_SYMBOLS) {
+    if (ctx->chains_size + 1 > MAX_SYMBOLS + 1) {
         fprintf(stderr, "error: MAX_SYMBOLS of %d was exceeded\n", MAX_SYMBOLS);
         exit(EXIT_FAILURE);
     }
 
-    chains[chains_size++] = chain;
+    ctx->chains[ctx->chains_size++] = chain;
 }
 
 // See https://flapenguin.me/elf-dt-hash
@@ -449,632 +1171,3713 @@ static void push_chain(u32 chain) {
 // 15  e                 | 101             2 **               |  (13)----/
 // 16  m                 | 109             1 **               \--(14)
 static void push_hash(void) {
-    hash_offset = bytes_size;
+    u32 nbucket = ctx->hash_nbucket;
+    push_u32(nbucket);
 
-    u32 nbucket = get_nbucket();
-    push_number(nbucket, 4);
+    u32 nchain = 1 + ctx->symbols_size; // `1 + `, because index 0 is always STN_UNDEF (the value 0)
+    push_u32(nchain);
 
-    u32 nchain = 1 + symbols_size; // `1 + `, because index 0 is always STN_UNDEF (the value 0)
-    push_number(nchain, 4);
+    memset(ctx->buckets, 0, nbucket * sizeof(u32));
 
-    memset(buckets, 0, nbucket * sizeof(u32));
+    ctx->chains[0] = 0; // The first entry in the chain is always STN_UNDEF
+    ctx->chains_size = nchain;
 
-    chains_size = 0;
-
-    push_chain(0); // The first entry in the chain is always STN_UNDEF
+    // ld inserts the symbols in shuffled order, even when .gnu.hash has sorted .dynsym differently
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        size_t symbol_index = ctx->shuffled_symbol_index_to_symbol_index[i];
+        u32 bucket_index = ctx->symbol_elf_hashes[symbol_index] % nbucket;
 
-    for (size_t i = 0; i < symbols_size; i++) {
-        u32 hash = elf_hash(shuffled_symbols[i]);
-        u32 bucket_index = hash % nbucket;
+        // `1 + `, because index 0 is always STN_UNDEF
+        u32 dynsym_index = 1 + ctx->symbol_index_to_dynsym_index[symbol_index];
 
-        push_chain(buckets[bucket_index]);
+        ctx->chains[dynsym_index] = ctx->buckets[bucket_index];
 
-        buckets[bucket_index] = i + 1;
+        ctx->buckets[bucket_index] = dynsym_index;
     }
 
     for (size_t i = 0; i < nbucket; i++) {
-        push_number(buckets[i], 4);
+        push_u32(ctx->buckets[i]);
+    }
+
+    for (size_t i = 0; i < ctx->chains_size; i++) {
+        push_u32(ctx->chains[i]);
+    }
+}
+
+// From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elf.c#l215
+static u32 bfd_elf_gnu_hash(const char *namearg, size_t len) {
+    u32 h = 5381;
+
+    const unsigned char *name = (const unsigned char *) namearg;
+    for (size_t i = 0; i < len; i++) {
+        h = (h << 5) + h + name[i];
+    }
+
+    return h;
+}
+
+static u32 get_symbol_gnu_hash(size_t symbol_index) {
+    return ctx->symbol_gnu_hashes[symbol_index];
+}
+
+// The number of bits in the bloom filter is 2^maskbitslog2
+// From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elflink.c#l7526
+static u32 get_gnu_hash_maskbitslog2(void) {
+    u32 log2 = 0;
+    for (size_t n = ctx->symbols_size; n > 1; n >>= 1) {
+        log2++;
     }
 
-    for (size_t i = 0; i < chains_size; i++) {
-        push_number(chains[i], 4);
+    u32 maskbitslog2 = log2 + 1;
+
+    if (maskbitslog2 < 3) {
+        maskbitslog2 = 5;
+    } else if ((1 << (maskbitslog2 - 2)) & ctx->symbols_size) {
+        maskbitslog2 += 3;
+    } else {
+        maskbitslog2 += 2;
+    }
+
+    // A 64-bit bloom filter word needs at least 2^6 bits
+    if (maskbitslog2 < GNU_HASH_SHIFT1) {
+        maskbitslog2 = GNU_HASH_SHIFT1;
+    }
+
+    return maskbitslog2;
+}
+
+// The number of 64-bit words in the bloom filter
+static u32 get_gnu_hash_maskwords(void) {
+    return 1 << (get_gnu_hash_maskbitslog2() - GNU_HASH_SHIFT1);
+}
+
+// See https://flapenguin.me/elf-dt-gnu-hash
+// See https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elflink.c#l6400
+//
+// .dynsym has already been sorted by bucket in init_dynsym_order(),
+// so every bucket is a contiguous run of symbols.
+// A chain value is the symbol its hash, with the lowest bit set for the last symbol of a bucket.
+//
+// The bloom filter sets two bits per symbol, which lets the dynamic linker reject
+// most names that aren't in this library without looking at any of the strings.
+static void push_gnu_hash(void) {
+    u32 maskbitslog2 = get_gnu_hash_maskbitslog2();
+    u32 shift2 = maskbitslog2;
+    u32 maskwords = get_gnu_hash_maskwords();
+
+    push_u32(ctx->gnu_hash_nbucket);
+    push_u32(1); // symoffset, which is 1 because only STN_UNDEF comes before the hashed symbols
+    push_u32(maskwords);
+    push_u32(shift2);
+
+    u64 *bloom = ctx->gnu_hash_bloom;
+    memset(bloom, 0, maskwords * sizeof(u64));
+
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        u32 hash = get_symbol_gnu_hash(ctx->dynsym_index_to_symbol_index[i]);
+        u64 *word = &bloom[(hash >> GNU_HASH_SHIFT1) & (maskwords - 1)];
+
+        *word |= (u64)1 << (hash % 64);
+        *word |= (u64)1 << ((hash >> shift2) % 64);
+    }
+
+    for (size_t i = 0; i < maskwords; i++) {
+        push_u64(bloom[i]);
+    }
+
+    // Every bucket holds the .dynsym index of its first symbol, or 0 if it's empty
+    u32 dynsym_index = 1;
+    for (size_t i = 0; i < ctx->gnu_hash_nbucket; i++) {
+        push_u32(ctx->gnu_hash_counts[i] > 0 ? dynsym_index : 0);
+        dynsym_index += ctx->gnu_hash_counts[i];
     }
 
-    hash_size = bytes_size - hash_offset;
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        u32 hash = get_symbol_gnu_hash(ctx->dynsym_index_to_symbol_index[i]);
+
+        bool is_last = i + 1 == ctx->symbols_size
+            || get_symbol_gnu_hash(ctx->dynsym_index_to_symbol_index[i + 1]) % ctx->gnu_hash_nbucket != hash % ctx->gnu_hash_nbucket;
 
-    push_alignment(8);
+        push_u32((hash & ~1) | is_last);
+    }
 }
 
 static void push_section_header(u32 name_offset, u32 type, u64 flags, u64 address, u64 offset, u64 size, u32 link, u32 info, u64 alignment, u64 entry_size) {
-    push_number(name_offset, 4);
-    push_number(type, 4);
-    push_number(flags, 8);
-    push_number(address, 8);
-    push_number(offset, 8);
-    push_number(size, 8);
-    push_number(link, 4);
-    push_number(info, 4);
-    push_number(alignment, 8);
-    push_number(entry_size, 8);
+    push_u32(name_offset);
+
+    // The debug file only describes the loaded sections, without containing them, like `objcopy --only-keep-debug` does
+    push_u32(ctx->is_debug_image && (flags & SHF_ALLOC) ? SHT_NOBITS : type);
+    push_u64(flags);
+    push_u64(address);
+    push_u64(offset);
+    push_u64(size);
+    push_u32(link);
+    push_u32(info);
+    push_u64(alignment);
+    push_u64(entry_size);
 }
 
 static void push_section_headers(void) {
-    section_headers_offset = bytes_size;
-
     // Null section
     // 0x31f0 to 0x3230
     push_zeros(0x40);
 
     // .hash: Hash section
     // 0x3230 to 0x3270
-    push_section_header(0x1b, SHT_HASH, SHF_ALLOC, hash_offset, hash_offset, hash_size, 2, 0, 8, 4);
+    // The "link" is the section header index of the symbol table the hash table applies to
+    if (ctx->hash_style & HASH_STYLE_SYSV) {
+        push_section_header(ctx->hash_name_offset, SHT_HASH, SHF_ALLOC, ctx->hash_offset, ctx->hash_offset, ctx->hash_size, ctx->dynsym_section_index, 0, 8, 4);
+    }
+
+    // .gnu.hash: GNU hash section
+    if (ctx->hash_style & HASH_STYLE_GNU) {
+        push_section_header(ctx->gnu_hash_name_offset, SHT_GNU_HASH, SHF_ALLOC, ctx->gnu_hash_offset, ctx->gnu_hash_offset, ctx->gnu_hash_size, ctx->dynsym_section_index, 0, 8, 0);
+    }
 
     // .dynsym: Dynamic linker symbol table section
     // 0x3270 to 0x32b0
-    push_section_header(0x21, SHT_DYNSYM, SHF_ALLOC, dynsym_offset, dynsym_offset, dynsym_size, 3, 1, 8, 0x18);
+    push_section_header(ctx->dynsym_name_offset, SHT_DYNSYM, SHF_ALLOC, ctx->dynsym_offset, ctx->dynsym_offset, ctx->dynsym_size, ctx->dynstr_section_index, 1, 8, 0x18);
 
     // .dynstr: String table section
     // 0x32b0 to 0x32f0
-    push_section_header(0x29, SHT_STRTAB, SHF_ALLOC, dynstr_offset, dynstr_offset, dynstr_size, 0, 0, 1, 0);
+    push_section_header(ctx->dynstr_name_offset, SHT_STRTAB, SHF_ALLOC, ctx->dynstr_offset, ctx->dynstr_offset, ctx->dynstr_size, 0, 0, 1, 0);
+
+    // .rela.dyn: Relocation section
+    // ld keeps it when every relocation got packed into .relr.dyn, even though it is empty then
+    if (ctx->relocations_size > 0) {
+        push_section_header(ctx->rela_dyn_name_offset, SHT_RELA, SHF_ALLOC, ctx->rela_dyn_offset, ctx->rela_dyn_offset, ctx->rela_dyn_size, ctx->dynsym_section_index, 0, 8, RELA_ENTRY_SIZE);
+    }
+
+    // .relr.dyn: Packed relative relocation section
+    if (ctx->relr_dyn_size > 0) {
+        push_section_header(ctx->relr_dyn_name_offset, SHT_RELR, SHF_ALLOC, ctx->relr_dyn_offset, ctx->relr_dyn_offset, ctx->relr_dyn_size, 0, 0, 8, RELR_ENTRY_SIZE);
+    }
 
     // .text: Code section
     // 0x32f0 to 0x3330
-    push_section_header(0x31, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, TEXT_OFFSET, TEXT_OFFSET, text_size, 0, 0, 16, 0);
+    if (has_text()) {
+        push_section_header(ctx->text_name_offset, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, ctx->text_offset, ctx->text_offset, ctx->text_size, 0, 0, ctx->text_alignment, 0);
+    }
+
+    // .rodata: Read-only data section
+    if (has_rodata()) {
+        push_section_header(ctx->rodata_name_offset, SHT_PROGBITS, SHF_ALLOC, ctx->rodata_offset, ctx->rodata_offset, ctx->rodata_size, 0, 0, 4, 0);
+    }
 
     // .eh_frame: Exception stack unwinding section
     // 0x3330 to 0x3370
-    push_section_header(0x37, SHT_PROGBITS, SHF_ALLOC, EH_FRAME_OFFSET, EH_FRAME_OFFSET, 0, 0, 0, 8, 0);
+    push_section_header(ctx->eh_frame_name_offset, SHT_PROGBITS, SHF_ALLOC, ctx->eh_frame_offset, ctx->eh_frame_offset, 0, 0, 0, 8, 0);
 
     // .dynamic: Dynamic linking information section
     // 0x3370 to 0x33b0
-    push_section_header(0x41, SHT_DYNAMIC, SHF_WRITE | SHF_ALLOC, DYNAMIC_OFFSET, DYNAMIC_OFFSET, 0xb0, 3, 0, 8, 0x10);
+    push_section_header(ctx->dynamic_name_offset, SHT_DYNAMIC, SHF_WRITE | SHF_ALLOC, ctx->dynamic_address, ctx->dynamic_offset, ctx->dynamic_size, ctx->dynstr_section_index, 0, 8, 0x10);
 
     // .data: Data section
     // 0x33b0 to 0x33f0
-    push_section_header(0x4a, SHT_PROGBITS, SHF_WRITE | SHF_ALLOC, DATA_OFFSET, DATA_OFFSET, data_size, 0, 0, 4, 0);
+    if (has_data()) {
+        push_section_header(ctx->data_name_offset, SHT_PROGBITS, SHF_WRITE | SHF_ALLOC, ctx->data_address, ctx->data_offset, ctx->data_size, 0, 0, 4, 0);
+    }
+
+    // .bss: Zero-initialized data section, which takes up no room in the file
+    if (has_bss()) {
+        push_section_header(ctx->bss_name_offset, SHT_NOBITS, SHF_WRITE | SHF_ALLOC, ctx->bss_address, ctx->bss_offset, get_bss_section_size(ctx->bss_address), 0, 0, 4, 0);
+    }
+
+    if (has_symtab()) {
+        // .symtab: Symbol table section
+        // 0x33f0 to 0x3430
+        // The "link" is the section header index of the associated string table
+        // The "info" of 4 is the symbol table index of the first non-local symbol, which is the 5th entry in push_symtab(), the global "b" symbol
+        push_section_header(ctx->symtab_name_offset, SHT_SYMTAB, 0, 0, ctx->symtab_offset, ctx->symtab_size, ctx->strtab_section_index, 4, 8, SYMTAB_ENTRY_SIZE);
 
-    // .symtab: Symbol table section
-    // 0x33f0 to 0x3430
-    // The "link" is the section header index of the associated string table
-    // The "info" of 4 is the symbol table index of the first non-local symbol, which is the 5th entry in push_symtab(), the global "b" symbol
-    push_section_header(0x1, SHT_SYMTAB, 0, 0, symtab_offset, symtab_size, STRTAB_SECTION_HEADER_INDEX, 4, 8, SYMTAB_ENTRY_SIZE);
+        // .strtab: String table section
+        // 0x3430 to 0x3470
+        push_section_header(ctx->strtab_name_offset, SHT_PROGBITS | SHT_SYMTAB, 0, 0, ctx->strtab_offset, ctx->strtab_size, 0, 0, 1, 0);
+    }
 
-    // .strtab: String table section
-    // 0x3430 to 0x3470
-    push_section_header(0x09, SHT_PROGBITS | SHT_SYMTAB, 0, 0, strtab_offset, strtab_size, 0, 0, 1, 0);
+    // .gnu_debuglink: Name and CRC-32 of the --split-debug file
+    if (has_gnu_debuglink()) {
+        push_section_header(ctx->gnu_debuglink_name_offset, SHT_PROGBITS, 0, 0, ctx->gnu_debuglink_offset, ctx->gnu_debuglink_size, 0, 0, 4, 0);
+    }
 
     // .shstrtab: Section header string table section
     // 0x3470 to end
-    push_section_header(0x11, SHT_PROGBITS | SHT_SYMTAB, 0, 0, shstrtab_offset, shstrtab_size, 0, 0, 1, 0);
+    push_section_header(ctx->shstrtab_name_offset, SHT_PROGBITS | SHT_SYMTAB, 0, 0, ctx->shstrtab_offset, ctx->shstrtab_size, 0, 0, 1, 0);
 }
 
 static void push_dynsym(void) {
-    dynsym_offset = bytes_size;
-
     // Null entry
     // 0x1d8 to 0x1f0
     push_symbol_entry(0, ELF32_ST_INFO(STB_LOCAL, STT_NOTYPE), SHN_UNDEF, 0);
 
-    // The symbols are pushed in shuffled_symbols order
-    for (size_t i = 0; i < symbols_size; i++) {
-        size_t symbol_index = shuffled_symbol_index_to_symbol_index[i];
-
-        bool is_data = symbol_index < 9; // TODO: Use the data symbol count from the AST
-        u16 shndx = is_data ? SYMTAB_SECTION_HEADER_INDEX : EH_FRAME_SECTION_HEADER_INDEX;
-        u32 offset = is_data ? DATA_OFFSET + data_offsets[symbol_index] : TEXT_OFFSET + text_offsets[symbol_index - 9]; // TODO: Use the data symbol count from the AST
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        size_t symbol_index = ctx->dynsym_index_to_symbol_index[i];
 
-        push_symbol_entry(symbol_name_dynstr_offsets[symbol_index], ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), shndx, offset);
+        push_symbol_entry(ctx->symbol_name_dynstr_offsets[symbol_index], ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), ctx->symbol_section_indices[symbol_index], ctx->symbol_values[symbol_index]);
     }
-
-    dynsym_size = bytes_size - dynsym_offset;
 }
 
 static void push_program_header(u32 type, u32 flags, u64 offset, u64 virtual_address, u64 physical_address, u64 file_size, u64 mem_size, u64 alignment) {
-    push_number(type, 4);
-    push_number(flags, 4);
-    push_number(offset, 8);
-    push_number(virtual_address, 8);
-    push_number(physical_address, 8);
-    push_number(file_size, 8);
-    push_number(mem_size, 8);
-    push_number(alignment, 8);
+    push_u32(type);
+    push_u32(flags);
+    push_u64(offset);
+    push_u64(virtual_address);
+    push_u64(physical_address);
+    push_u64(ctx->is_debug_image ? 0 : file_size); // The debug file doesn't contain the segments
+    push_u64(mem_size);
+    push_u64(alignment);
 }
 
 static void push_program_headers(void) {
-    // .hash, .dynsym, .dynstr segment
-    // 0x40 to 0x78
-    // file_size and mem_size get overwritten later
-    push_program_header(PT_LOAD, PF_R, 0, 0, 0, 0, 0, 0x1000);
-
-    // TODO: Use the data from the AST
-    data_size += 3; // "define" label
-    data_size += sizeof("a^");
-    data_size += sizeof("b^");
-    data_size += sizeof("c^");
-    data_size += sizeof("d^");
-    data_size += sizeof("e^");
-    data_size += sizeof("f^");
-    data_size += sizeof("g^");
-    data_size += sizeof("h^");
-
-    // .text segment
-    // 0x78 to 0xb0
-    push_program_header(PT_LOAD, PF_R | PF_X, TEXT_OFFSET, TEXT_OFFSET, TEXT_OFFSET, 12, 12, 0x1000);
-
-    // .eh_frame segment
-    // 0xb0 to 0xe8
-    push_program_header(PT_LOAD, PF_R, EH_FRAME_OFFSET, EH_FRAME_OFFSET, EH_FRAME_OFFSET, 0, 0, 0x1000);
-
-    // .dynamic, .data
+    if (ctx->separate_code) {
+        // .hash, .dynsym, .dynstr segment
+        // 0x40 to 0x78
+        push_program_header(PT_LOAD, PF_R, 0, 0, 0, ctx->segment_0_size, ctx->segment_0_size, ctx->max_page_size);
+
+        // .text segment
+        // 0x78 to 0xb0
+        if (has_text_segment()) {
+            push_program_header(PT_LOAD, PF_R | PF_X, ctx->text_offset, ctx->text_offset, ctx->text_offset, ctx->text_segment_size, ctx->text_segment_size, ctx->max_page_size);
+        }
+
+        // .rodata, .eh_frame segment
+        // 0xb0 to 0xe8
+        if (has_rodata_segment()) {
+            size_t rodata_segment_offset = has_rodata() ? ctx->rodata_offset : ctx->eh_frame_offset;
+            size_t rodata_segment_size = ctx->eh_frame_offset - rodata_segment_offset; // .eh_frame is always empty
+            push_program_header(PT_LOAD, PF_R, rodata_segment_offset, rodata_segment_offset, rodata_segment_offset, rodata_segment_size, rodata_segment_size, ctx->max_page_size);
+        }
+    } else {
+        // The headers, .hash, .dynsym, .dynstr, .text, .rodata and .eh_frame share a single segment,
+        // which ld only makes executable when there is code in it
+        u32 flags = has_text() ? PF_R | PF_X : PF_R;
+        push_program_header(PT_LOAD, flags, 0, 0, 0, ctx->segment_0_size, ctx->segment_0_size, ctx->max_page_size);
+    }
+
+    // .dynamic, .data, .bss
     // 0xe8 to 0x120
-    push_program_header(PT_LOAD, PF_R | PF_W, 0x2f50, 0x2f50, 0x2f50, 0xb0 + data_size, 0xb0 + data_size, 0x1000);
+    // The dynamic linker zeros the memory after the file size, which is where .bss is
+    size_t data_segment_file_size = ctx->dynamic_size + ctx->data_size;
+    size_t data_segment_mem_size = has_bss() ? ctx->bss_address + get_bss_section_size(ctx->bss_address) - ctx->dynamic_address : data_segment_file_size;
+    push_program_header(PT_LOAD, PF_R | PF_W, ctx->dynamic_offset, ctx->dynamic_address, ctx->dynamic_address, data_segment_file_size, data_segment_mem_size, ctx->max_page_size);
 
     // .dynamic segment
     // 0x120 to 0x158
-    push_program_header(PT_DYNAMIC, PF_R | PF_W, 0x2f50, 0x2f50, 0x2f50, 0xb0, 0xb0, 8);
+    push_program_header(PT_DYNAMIC, PF_R | PF_W, ctx->dynamic_offset, ctx->dynamic_address, ctx->dynamic_address, ctx->dynamic_size, ctx->dynamic_size, 8);
 
-    // .dynamic segment
-    // 0x158 to 0x190
-    push_program_header(PT_GNU_RELRO, PF_R, 0x2f50, 0x2f50, 0x2f50, 0xb0, 0xb0, 1);
+    if (ctx->relro) {
+        // .dynamic segment
+        // 0x158 to 0x190
+        push_program_header(PT_GNU_RELRO, PF_R, ctx->dynamic_offset, ctx->dynamic_address, ctx->dynamic_address, ctx->dynamic_size, ctx->dynamic_size, 1);
+    }
 }
 
 static void push_elf_header(void) {
-    // Magic number
-    // 0x0 to 0x4
-    push_byte(0x7f);
-    push_byte('E');
-    push_byte('L');
-    push_byte('F');
-
-    // 64-bit
-    // 0x4 to 0x5
-    push_byte(2);
-
-    // Little-endian
-    // 0x5 to 0x6
-    push_byte(1);
-
-    // Version
-    // 0x6 to 0x7
-    push_byte(1);
-
-    // SysV OS ABI
-    // 0x7 to 0x8
-    push_byte(0);
-
-    // Padding
-    // 0x8 to 0x10
-    push_zeros(8);
+    // Magic number, 64-bit, little-endian, version, SysV OS ABI, padding
+    // 0x0 to 0x10
+    static const u8 ident[] = {
+        0x7f, 'E', 'L', 'F', // Magic number
+        2, // 64-bit
+        1, // Little-endian
+        1, // Version
+        0, // SysV OS ABI
+        0, 0, 0, 0, 0, 0, 0, 0, // Padding
+    };
+    push_span(ident, sizeof(ident));
 
     // Shared object
     // 0x10 to 0x12
-    push_byte(ET_DYN);
-    push_byte(0);
+    push_u16(ET_DYN);
 
     // x86-64 instruction set architecture
     // 0x12 to 0x14
-    push_byte(0x3E);
-    push_byte(0);
+    push_u16(0x3E);
 
     // Original version of ELF
     // 0x14 to 0x18
-    push_byte(1);
-    push_zeros(3);
+    push_u32(1);
 
     // Execution entry point address
     // 0x18 to 0x20
-    push_zeros(8);
+    push_u64(0);
 
     // Program header table offset
     // 0x20 to 0x28
-    push_byte(0x40);
-    push_zeros(7);
+    push_u64(ELF_HEADER_SIZE);
 
-    // Section header table offset (this value gets overwritten later)
+    // Section header table offset
     // 0x28 to 0x30
-    push_zeros(8);
+    push_u64(ctx->section_headers_offset);
 
     // Processor-specific flags
     // 0x30 to 0x34
-    push_zeros(4);
+    push_u32(0);
 
     // ELF header size
     // 0x34 to 0x36
-    push_byte(0x40);
-    push_byte(0);
+    push_u16(ELF_HEADER_SIZE);
 
     // Single program header size
     // 0x36 to 0x38
-    push_byte(0x38);
-    push_byte(0);
+    push_u16(PROGRAM_HEADER_SIZE);
 
     // Number of program header entries
     // 0x38 to 0x3a
-    push_byte(6);
-    push_byte(0);
+    push_u16(ctx->program_header_count);
 
     // Single section header entry size
     // 0x3a to 0x3c
-    push_byte(0x40);
-    push_byte(0);
+    push_u16(SECTION_HEADER_SIZE);
 
     // Number of section header entries
     // 0x3c to 0x3e
-    push_byte(11);
-    push_byte(0);
+    push_u16(ctx->section_count);
 
     // Index of entry with section names
     // 0x3e to 0x40
-    push_byte(10);
-    push_byte(0);
+    push_u16(ctx->shstrtab_section_index);
+}
+
+// The debug file of --split-debug holds the headers, the symbol table, and the section headers
+static void push_debug_bytes(void) {
+    push_elf_header();
+    push_program_headers();
+
+    push_padding(ctx->symtab_offset);
+    push_symtab();
+
+    push_padding(ctx->strtab_offset);
+    push_strtab();
+
+    push_padding(ctx->shstrtab_offset);
+    push_shstrtab();
+
+    push_padding(ctx->section_headers_offset);
+    push_section_headers();
 }
 
 static void push_bytes() {
     // 0x0 to 0x40
+    begin_phase();
     push_elf_header();
+    end_phase("push_elf_header");
 
     // 0x40 to 0x190
+    begin_phase();
     push_program_headers();
+    end_phase("push_program_headers");
 
     // 0x190 to 0x1d8
-    push_hash();
+    if (ctx->hash_style & HASH_STYLE_SYSV) {
+        push_padding(ctx->hash_offset);
+        begin_phase();
+        push_hash();
+        end_phase("push_hash");
+    }
+
+    if (ctx->hash_style & HASH_STYLE_GNU) {
+        push_padding(ctx->gnu_hash_offset);
+        begin_phase();
+        push_gnu_hash();
+        end_phase("push_gnu_hash");
+    }
 
     // 0x1d8 to 0x2f8
+    push_padding(ctx->dynsym_offset);
+    begin_phase();
     push_dynsym();
+    end_phase("push_dynsym");
 
     // 0x2f8 to 0x318
+    push_padding(ctx->dynstr_offset);
+    begin_phase();
     push_dynstr();
+    end_phase("push_dynstr");
+
+    if (ctx->relocations_size > 0) {
+        push_padding(ctx->rela_dyn_offset);
+        begin_phase();
+        push_rela_dyn();
+        end_phase("push_rela_dyn");
+    }
 
-    // 0x318 to 0x1000
-    push_zeros(TEXT_OFFSET - bytes_size);
+    if (ctx->relr_dyn_size > 0) {
+        push_padding(ctx->relr_dyn_offset);
+        begin_phase();
+        push_relr_dyn();
+        end_phase("push_relr_dyn");
+    }
 
-    // 0x1000 to 0x1010
-    push_text();
+    // 0x1000 to 0x100c
+    if (has_text()) {
+        push_padding(ctx->text_offset);
+        begin_phase();
+        push_text();
+        end_phase("push_text");
+    }
 
-    // 0x1010 to 0x2f50
-    push_zeros(DYNAMIC_OFFSET - bytes_size);
+    if (has_rodata()) {
+        push_padding(ctx->rodata_offset);
+        begin_phase();
+        push_rodata();
+        end_phase("push_rodata");
+    }
 
     // 0x2f50 to 0x3000
+    push_padding(ctx->dynamic_offset);
+    begin_phase();
     push_dynamic();
+    end_phase("push_dynamic");
+
+    // 0x3000 to 0x301b
+    if (has_data()) {
+        push_padding(ctx->data_offset);
+        begin_phase();
+        push_data();
+        end_phase("push_data");
+    }
 
-    // 0x3000 to 0x3020
-    push_data();
-
-    // 0x3020 to 0x3170
-    push_symtab();
+    if (has_symtab()) {
+        // 0x3020 to 0x3170
+        push_padding(ctx->symtab_offset);
+        begin_phase();
+        push_symtab();
+        end_phase("push_symtab");
+
+        // 0x3170 to 0x31a0
+        push_padding(ctx->strtab_offset);
+        begin_phase();
+        push_strtab();
+        end_phase("push_strtab");
+    }
 
-    // 0x3170 to 0x31a0
-    push_strtab();
+    if (has_gnu_debuglink()) {
+        push_padding(ctx->gnu_debuglink_offset);
+        push_gnu_debuglink();
+    }
 
     // 0x31a0 to 0x31f0
+    push_padding(ctx->shstrtab_offset);
+    begin_phase();
     push_shstrtab();
+    end_phase("push_shstrtab");
 
     // 0x31f0 to end
+    push_padding(ctx->section_headers_offset);
+    begin_phase();
     push_section_headers();
+    end_phase("push_section_headers");
 }
 
-static void init_text_offsets(void) {
-    // TODO: Use the data from the AST
-    for (size_t i = 0; i < 2; i++) {
-        text_offsets[i] = i * 6; // fn1_c takes 6 bytes of instructions
+// Returns the offset of the name in .shstrtab
+static u32 add_section_name(char *name) {
+    if (ctx->section_names_size + 1 > MAX_SECTION_NAMES) {
+        fprintf(stderr, "error: MAX_SECTION_NAMES of %d was exceeded\n", MAX_SECTION_NAMES);
+        exit(EXIT_FAILURE);
     }
+
+    ctx->section_names[ctx->section_names_size++] = name;
+
+    u32 offset = ctx->shstrtab_size;
+    ctx->shstrtab_size += strlen(name) + 1;
+    return offset;
 }
 
-static void init_data_offsets(void) {
-    // TODO: Use the data from the AST
-    data_offsets[0] = 0; // "define" label
-    for (size_t i = 0; i < 8; i++) {
-        // 3 is the size of the "define" label
-        data_offsets[i + 1] = 3 + i * sizeof("a^");
+// The names are stored in the order ld uses
+static void init_section_names(void) {
+    ctx->section_names_size = 0;
+
+    // .shstrtab always starts with a '\0'
+    ctx->shstrtab_size = 1;
+
+    if (has_symtab()) {
+        ctx->symtab_name_offset = add_section_name(".symtab");
+        ctx->strtab_name_offset = add_section_name(".strtab");
+    }
+    ctx->shstrtab_name_offset = add_section_name(".shstrtab");
+
+    if (ctx->hash_style & HASH_STYLE_GNU) {
+        ctx->gnu_hash_name_offset = add_section_name(".gnu.hash");
+
+        // ".hash" is stored at the end of ".gnu.hash"
+        ctx->hash_name_offset = ctx->gnu_hash_name_offset + sizeof(".gnu") - 1;
+    } else {
+        ctx->hash_name_offset = add_section_name(".hash");
+    }
+
+    ctx->dynsym_name_offset = add_section_name(".dynsym");
+    ctx->dynstr_name_offset = add_section_name(".dynstr");
+    if (ctx->relocations_size > 0) {
+        ctx->rela_dyn_name_offset = add_section_name(".rela.dyn");
+    }
+    if (ctx->relr_dyn_size > 0) {
+        ctx->relr_dyn_name_offset = add_section_name(".relr.dyn");
+    }
+    if (has_text()) {
+        ctx->text_name_offset = add_section_name(".text");
+    }
+    if (has_rodata()) {
+        ctx->rodata_name_offset = add_section_name(".rodata");
+    }
+    ctx->eh_frame_name_offset = add_section_name(".eh_frame");
+    ctx->dynamic_name_offset = add_section_name(".dynamic");
+    if (has_data()) {
+        ctx->data_name_offset = add_section_name(".data");
+    }
+    if (has_bss()) {
+        ctx->bss_name_offset = add_section_name(".bss");
+    }
+
+    // objcopy --add-gnu-debuglink appends it
+    if (has_gnu_debuglink()) {
+        ctx->gnu_debuglink_name_offset = add_section_name(".gnu_debuglink");
     }
 }
 
-// haystack="a" , needle="a" => returns 0
-// haystack="ab", needle="b" => returns 1
-// haystack="a" , needle="b" => returns -1
-// haystack="a" , needle="ab" => returns -1
-static size_t get_ending_index(char *haystack, char *needle) {
-  // Go to the end of the haystack and the needle
-  char *hp = haystack;
-  while (*hp) {
-    hp++;
-  }
-  char *np = needle;
-  while (*np) {
-    np++;
-  }
+// Lays out the sections that aren't loaded into memory, starting at the offset
+static void init_unloaded_layout(size_t offset) {
+    if (has_symtab()) {
+        ctx->symtab_offset = align_up(offset, 8);
+        ctx->symtab_size = (SYMTAB_LOCAL_ENTRY_COUNT + ctx->symbols_size) * SYMTAB_ENTRY_SIZE;
 
-  // If the needle is longer than the haystack, it can't fit
-  if (np - needle > hp - haystack) {
-    return -1;
-  }
+        ctx->strtab_offset = ctx->symtab_offset + (SYMTAB_LOCAL_ENTRY_COUNT + ctx->reserved_symbols_size) * SYMTAB_ENTRY_SIZE;
+        // strtab_size was computed by init_symbol_name_strtab_offsets()
 
-  while (true) {
-    // If one of the characters doesn't match
-    if (*hp != *np) {
-      return -1;
+        offset = ctx->strtab_offset + ctx->strtab_reserved_size;
     }
 
-    // If the needle entirely fits into the end of the haystack,
-    // return the index where needle starts in haystack
-    if (np == needle) {
-      return hp - haystack; 
+    if (has_gnu_debuglink()) {
+        char debug_path[4096];
+        get_debug_path(debug_path, sizeof(debug_path));
+
+        // The name is padded to a multiple of 4 bytes, and followed by the CRC-32
+        ctx->gnu_debuglink_offset = align_up(offset, 4);
+        ctx->gnu_debuglink_size = align_up(strlen(get_basename(debug_path)) + 1, 4) + 4;
+
+        offset = ctx->gnu_debuglink_offset + ctx->gnu_debuglink_size;
     }
 
-    hp--;
-    np--;
-  }
+    ctx->shstrtab_offset = offset;
+    // shstrtab_size was computed by init_section_names()
+
+    ctx->section_headers_offset = align_up(ctx->shstrtab_offset + ctx->shstrtab_size, 8);
 }
 
-static void init_symbol_name_strtab_offsets(void) {
-    size_t offset = 1;
+// Returns how much room --incremental reserves for a section to grow into
+static size_t get_slack_size(size_t size, size_t min_slack_size) {
+    return ctx->incremental ? size / 4 + min_slack_size : 0;
+}
 
-    static size_t parent_indices[MAX_SYMBOLS];
-    static size_t substr_offsets[MAX_SYMBOLS];
+// Returns where the writable segment ends in memory when it starts at the address, which is after .bss when there is one
+static size_t get_data_segment_end(size_t dynamic_address) {
+    size_t end = dynamic_address + ctx->dynamic_size + ctx->data_reserved_size;
+    if (has_bss()) {
+        size_t bss_address = align_up(end, 4);
+        end = bss_address + get_bss_section_size(bss_address);
+    }
+    return end;
+}
 
-    memset(parent_indices, -1, symbols_size * sizeof(size_t));
+// Computes the offset and size of every section from their contents,
+// in the same way that ld its default linker script for shared objects lays them out
+// See the output of `ld --verbose -shared`
+//
+// Every segment starts at the same offset within a page in the file as in memory,
+// so the virtual address of every section is equal to its file offset,
+// except for the writable segment when `-z noseparate-code` lets it start on the same page in the file as the code
+static void init_layout(void) {
+    ctx->program_header_count = 3 + has_text_segment() + has_rodata_segment(); // The first and writable PT_LOAD, and PT_DYNAMIC
+    if (ctx->relro) {
+        ctx->program_header_count++; // PT_GNU_RELRO
+    }
 
-    // This function could be optimized from O(n^2) to O(n) with a hash map
-    for (size_t i = 0; i < symbols_size; i++) {
-        size_t symbol_index = shuffled_symbol_index_to_symbol_index[i];
-        char *symbol = symbols[symbol_index];
+    // The padding of the .text segment would overlap the segment after it otherwise
+    if (ctx->pad_text_segment && !ctx->separate_code) {
+        fprintf(stderr, "error: --huge-page-text requires -z separate-code\n");
+        exit(EXIT_FAILURE);
+    }
 
-        size_t parent_index;
-        size_t ending_index;
-        for (parent_index = 0; parent_index < symbols_size; parent_index++) {
-            if (symbol_index != parent_index) {
-                ending_index = get_ending_index(symbols[parent_index], symbol);
-                if (ending_index != (size_t)-1) {
-                    break;
-                }
-            }
+    // .gnu.hash requires .dynsym to be sorted by bucket, so symbols can't be appended to it
+    if (ctx->incremental && ctx->hash_style != HASH_STYLE_SYSV) {
+        fprintf(stderr, "error: --incremental requires --hash-style=sysv\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The previous output is also where --incremental reads the source path from
+    if (ctx->incremental && ctx->strip_all) {
+        fprintf(stderr, "error: --incremental can't be combined with --strip-all or --split-debug\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->reserved_symbols_size = ctx->symbols_size + get_slack_size(ctx->symbols_size, MIN_SLACK_SYMBOLS);
+    ctx->dynstr_reserved_size = ctx->dynstr_size + get_slack_size(ctx->dynstr_size, MIN_SLACK_BYTES);
+    ctx->text_reserved_size = has_text() ? ctx->text_size + get_slack_size(ctx->text_size, MIN_SLACK_BYTES) : 0;
+    ctx->rodata_reserved_size = ctx->rodata_size + get_slack_size(ctx->rodata_size, MIN_SLACK_BYTES);
+    ctx->data_reserved_size = ctx->data_size + get_slack_size(ctx->data_size, MIN_SLACK_BYTES);
+    ctx->strtab_reserved_size = ctx->strtab_size + get_slack_size(ctx->strtab_size, MIN_SLACK_BYTES);
+
+    size_t offset = ELF_HEADER_SIZE + ctx->program_header_count * PROGRAM_HEADER_SIZE;
+
+    if (ctx->hash_style & HASH_STYLE_SYSV) {
+        ctx->hash_offset = align_up(offset, 8);
+        ctx->hash_size = (2 + ctx->hash_nbucket + 1 + ctx->symbols_size) * 4; // nbucket, nchain, buckets and chains
+        offset = ctx->hash_offset + (2 + ctx->hash_nbucket + 1 + ctx->reserved_symbols_size) * 4;
+    }
+
+    if (ctx->hash_style & HASH_STYLE_GNU) {
+        ctx->gnu_hash_offset = align_up(offset, 8);
+        ctx->gnu_hash_size = 4 * 4 + get_gnu_hash_maskwords() * 8 + (ctx->gnu_hash_nbucket + ctx->symbols_size) * 4; // Header, bloom filter, buckets and chains
+        offset = ctx->gnu_hash_offset + ctx->gnu_hash_size;
+    }
+
+    ctx->dynsym_offset = align_up(offset, 8);
+    ctx->dynsym_size = (1 + ctx->symbols_size) * SYMTAB_ENTRY_SIZE;
+
+    ctx->dynstr_offset = ctx->dynsym_offset + (1 + ctx->reserved_symbols_size) * SYMTAB_ENTRY_SIZE;
+    // dynstr_size was computed by init_symbol_name_dynstr_offsets()
+
+    offset = ctx->dynstr_offset + ctx->dynstr_reserved_size;
+
+    // The sizes were computed by init_relocations()
+    if (ctx->relocations_size > 0) {
+        ctx->rela_dyn_offset = align_up(offset, 8);
+        offset = ctx->rela_dyn_offset + ctx->rela_dyn_size;
+    }
+    if (ctx->relr_dyn_size > 0) {
+        ctx->relr_dyn_offset = align_up(offset, 8);
+        offset = ctx->relr_dyn_offset + ctx->relr_dyn_size;
+    }
+
+    if (ctx->separate_code) {
+        ctx->segment_0_size = offset;
+
+        // With `-z separate-code` the code starts on a new page
+        ctx->text_offset = align_up(offset, ctx->max_page_size);
+
+        // And so does the read-only data after the code
+        size_t rodata_segment_offset = align_up(ctx->text_offset + ctx->text_reserved_size, ctx->max_page_size);
+        offset = rodata_segment_offset;
+        if (has_rodata()) {
+            ctx->rodata_offset = offset;
+            offset = ctx->rodata_offset + ctx->rodata_reserved_size;
         }
+        ctx->eh_frame_offset = align_up(offset, 8);
 
-        // If symbol wasn't in the end of another symbol
-        bool is_substr = parent_index != symbols_size;
+        // --huge-page-text extends the .text segment over the padding up to the next huge page,
+        // since the kernel can only back the parts of a mapping that cover a whole huge page with one
+        ctx->text_segment_size = ctx->pad_text_segment ? rodata_segment_offset - ctx->text_offset : ctx->text_size;
 
-        if (is_substr) {
-            parent_indices[symbol_index] = parent_index;
-            substr_offsets[symbol_index] = ending_index;
-        } else {
-            symbol_name_strtab_offsets[symbol_index] = offset;
-            offset += strlen(symbol) + 1;
+        // Without code, the first segment stretches over the padding to the read-only data instead, see has_rodata_segment()
+        if (!has_text_segment()) {
+            ctx->segment_0_size = ctx->eh_frame_offset;
         }
+    } else {
+        // Otherwise the code and read-only data are packed after the headers, in the same segment
+        ctx->text_offset = has_text() ? align_up(offset, ctx->text_alignment) : offset;
+        offset = ctx->text_offset + ctx->text_reserved_size;
+        if (has_rodata()) {
+            ctx->rodata_offset = align_up(offset, 4);
+            offset = ctx->rodata_offset + ctx->rodata_reserved_size;
+        }
+        ctx->eh_frame_offset = align_up(offset, 8);
+
+        ctx->segment_0_size = ctx->eh_frame_offset;
     }
 
-    // Now that all the parents have been given final offsets in .strtab,
-    // it is clear what index their substring symbols have
-    for (size_t i = 0; i < symbols_size; i++) {
-        size_t parent_index = parent_indices[i];
-        if (parent_index != (size_t)-1) {
-            size_t parent_offset = symbol_name_strtab_offsets[parent_index];
-            symbol_name_strtab_offsets[i] = parent_offset + substr_offsets[i];
+    // DATA_SEGMENT_ALIGN starts the writable segment at the same offset within the next page as where .eh_frame ends,
+    // so that it doesn't share a page of memory with the read-only segment
+    // See https://sourceware.org/binutils/docs/ld/Builtin-Functions.html
+    size_t eh_frame_end = ctx->eh_frame_offset; // .eh_frame is always empty
+    ctx->dynamic_address = align_up(eh_frame_end, ctx->max_page_size) + (eh_frame_end & (ctx->max_page_size - 1));
+    ctx->dynamic_size = get_dynamic_entry_count() * DYNAMIC_ENTRY_SIZE;
+
+    // DATA_SEGMENT_RELRO_END then moves .dynamic so that it ends at the first page boundary
+    // where it doesn't share a page with the read-only segment,
+    // which lets the dynamic linker mprotect() it as read-only after relocating
+    // See lang_size_relro_segment_1() in https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=ld/ldlang.c
+    //
+    // Without it, the writable segment starts at the first common page boundary in the next maximum page instead
+    // when it would otherwise straddle a common page, while it fits in a single one
+    // See lang_size_segment() in https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=ld/ldlang.c
+    if (ctx->relro) {
+        ctx->dynamic_address = align_up(align_up(eh_frame_end, ctx->max_page_size) + ctx->dynamic_size, ctx->max_page_size) - ctx->dynamic_size;
+    } else {
+        size_t data_segment_end = get_data_segment_end(ctx->dynamic_address);
+        size_t first = -ctx->dynamic_address & (PAGE_SIZE - 1);
+        size_t last = data_segment_end & (PAGE_SIZE - 1);
+        bool straddles_page = ctx->dynamic_address / PAGE_SIZE != data_segment_end / PAGE_SIZE;
+        if (first > 0 && last > 0 && straddles_page && first + last <= PAGE_SIZE) {
+            ctx->dynamic_address = align_up(eh_frame_end, ctx->max_page_size) + (align_up(eh_frame_end, PAGE_SIZE) & (ctx->max_page_size - 1));
         }
     }
-}
 
-static void push_shuffled_symbol(char *shuffled_symbol) {
-    if (shuffled_symbols_size + 1 > MAX_SYMBOLS) {
-        fprintf(stderr, "error: MAX_SYMBOLS of %d was exceeded\n", MAX_SYMBOLS);
+    // The writable segment gets the first file offset after .eh_frame that is at the same offset within a page
+    ctx->dynamic_offset = eh_frame_end + ((ctx->dynamic_address - eh_frame_end) & (ctx->max_page_size - 1));
+
+    ctx->data_address = ctx->dynamic_address + ctx->dynamic_size;
+    ctx->data_offset = ctx->dynamic_offset + ctx->dynamic_size;
+
+    ctx->bss_address = align_up(ctx->data_address + ctx->data_reserved_size, 4);
+    ctx->bss_offset = ctx->data_offset + ctx->data_reserved_size;
+
+    // The symbol values are only 32 bits, see push_symbol_entry(), which the sections in the writable segment would overflow first,
+    // since it comes after .text and .rodata
+    // Their sizes are checked while assembling, but the padding of the segments pushes the last ones further
+    size_t data_segment_end = get_data_segment_end(ctx->dynamic_address);
+    if (data_segment_end > UINT32_MAX) {
+        fprintf(stderr, "error: The sections end at address 0x%zx, which is past the 4 GiB that symbol values can hold\n", data_segment_end);
         exit(EXIT_FAILURE);
     }
 
-    shuffled_symbols[shuffled_symbols_size++] = shuffled_symbol;
+    // The sections that aren't loaded into memory follow
+    init_unloaded_layout(ctx->data_offset + ctx->data_reserved_size);
 }
 
-// This is solely here to put the symbols in the same weird order as ld does
-// From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/hash.c#l508
-static unsigned long bfd_hash_hash(const char *string) {
-    const unsigned char *s;
-    unsigned long hash;
-    unsigned int len;
-    unsigned int c;
+// ld sorts the relocations against symbols by the offset of the first relocation against the same symbol,
+// so all of the relocations against a symbol are next to each other
+// See elf_link_sort_relocs() in https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elflink.c
+static int compare_rela_relocations(const void *a, const void *b) {
+    u32 index_a = *(const u32 *)a;
+    u32 index_b = *(const u32 *)b;
+
+    u32 first_offset_a = ctx->symbol_first_relocation_offsets[ctx->relocation_symbol_indices[index_a]];
+    u32 first_offset_b = ctx->symbol_first_relocation_offsets[ctx->relocation_symbol_indices[index_b]];
+    if (first_offset_a != first_offset_b) {
+        return first_offset_a < first_offset_b ? -1 : 1;
+    }
 
-    hash = 0;
-    len = 0;
-    s = (const unsigned char *) string;
-    while ((c = *s++) != '\0') {
-        hash += c + (c << 17);
-        hash ^= hash >> 2;
+    u32 offset_a = ctx->relocation_section_offsets[index_a];
+    u32 offset_b = ctx->relocation_section_offsets[index_b];
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+static void push_relr_entry(u64 entry) {
+    if (ctx->relr_entries_size + 1 > MAX_RELOCATIONS) {
+        fprintf(stderr, "error: MAX_RELOCATIONS of %d was exceeded\n", MAX_RELOCATIONS);
+        exit(EXIT_FAILURE);
     }
-    len = (s - (const unsigned char *) string) - 1;
-    hash += len + (len << 17);
-    hash ^= hash >> 2;
-    return hash;
+
+    ctx->relr_entries[ctx->relr_entries_size++] = entry;
 }
 
-// See the documentation of push_hash() for how this function roughly works
+// Every run of relocations starts with the address of the first one,
+// followed by bitmaps of which of the next 63 words need to be relocated as well
+// From elf_x86_compute_dl_relr_bitmap() in https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elfxx-x86.c
 //
-// name | index
-// "a"  | 3485
-// "b"  |  245
-// "c"  | 2224
-// "d"  | 2763
-// "e"  | 3574
-// "f"  |  553
-// "g"  |  872
-// "h"  | 3042
-// "i"  | 1868
-// "j"  |  340
-// "k"  | 1151
-// "l"  | 1146
-// "m"  | 3669
-// "n"  |  429
-// "o"  |  967
-// "p"  |  256
+// The addresses are relative to .data, which is always 4-byte aligned,
+// so whether a relocation is even, or a whole number of words away from another, doesn't depend on the layout
+static void init_relr_entries(u32 *offsets, size_t offsets_size) {
+    ctx->relr_entries_size = 0;
+
+    for (size_t i = 0; i < offsets_size;) {
+        u64 base = offsets[i++];
+        push_relr_entry(base);
+        base += 8;
+
+        while (true) {
+            u64 bitmap = 0;
+
+            for (; i < offsets_size; i++) {
+                u64 delta = offsets[i] - base;
+                if (delta >= RELR_BITMAP_BITS * 8 || delta % 8 != 0) {
+                    break;
+                }
+                bitmap |= 1ULL << (delta / 8);
+            }
+
+            if (bitmap == 0) {
+                break;
+            }
+
+            push_relr_entry(bitmap << 1 | 1);
+            base += RELR_BITMAP_BITS * 8;
+        }
+    }
+}
+
+// Without -Bsymbolic another object may interpose any of the symbols, so every relocation is an R_X86_64_64 against the symbol,
+// while with -Bsymbolic the symbols are known to be in this object, so only the load address has to be added with R_X86_64_RELATIVE
 //
-// This gets shuffled by ld to this:
-// (see https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/hash.c#l618)
-// "b"
-// "p"
-// "j"
-// "n"
-// "f"
-// "g"
-// "o"
-// "l"
-// "k"
-// "i"
-// "c"
-// "d"
-// "h"
-// "a"
-// "e"
-// "m"
-static void generate_shuffled_symbols(void) {
-    #define DEFAULT_SIZE 4051 // From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/hash.c#l345
+// -z pack-relative-relocs moves the R_X86_64_RELATIVE relocations to .relr.dyn, which can only hold even addresses
+static void init_relocations(void) {
+    ctx->rela_relocations_size = 0;
+    ctx->relative_rela_relocations_size = 0;
+    ctx->relr_entries_size = 0;
+
+    if (!ctx->is_symbolic) {
+        for (size_t i = ctx->relocations_size; i > 0; i--) {
+            u32 relocation_index = i - 1;
+            ctx->symbol_first_relocation_offsets[ctx->relocation_symbol_indices[relocation_index]] = ctx->relocation_section_offsets[relocation_index];
+        }
 
-    static u32 buckets[DEFAULT_SIZE];
+        for (size_t i = 0; i < ctx->relocations_size; i++) {
+            ctx->rela_relocation_indices[ctx->rela_relocations_size++] = i;
+        }
 
-    memset(buckets, 0, DEFAULT_SIZE * sizeof(u32));
+        qsort(ctx->rela_relocation_indices, ctx->rela_relocations_size, sizeof(u32), compare_rela_relocations);
+    } else {
+        // The relocations are already sorted by offset, which is the order of R_X86_64_RELATIVE relocations
+        // Reusing the buckets array to hold the offsets of the packed ones
+        u32 *relr_offsets = ctx->buckets;
+        size_t relr_offsets_size = 0;
 
-    chains_size = 0;
+        for (size_t i = 0; i < ctx->relocations_size; i++) {
+            u32 offset = ctx->relocation_section_offsets[i];
 
-    push_chain(0); // The first entry in the chain is always STN_UNDEF
+            if (ctx->pack_relative_relocs && offset % 2 == 0) {
+                relr_offsets[relr_offsets_size++] = offset;
+            } else {
+                ctx->rela_relocation_indices[ctx->rela_relocations_size++] = i;
+            }
+        }
 
-    for (size_t i = 0; i < symbols_size; i++) {
-        u32 hash = bfd_hash_hash(symbols[i]);
-        u32 bucket_index = hash % DEFAULT_SIZE;
+        ctx->relative_rela_relocations_size = ctx->rela_relocations_size;
+
+        init_relr_entries(relr_offsets, relr_offsets_size);
+    }
 
-        push_chain(buckets[bucket_index]);
+    ctx->rela_dyn_size = ctx->rela_relocations_size * RELA_ENTRY_SIZE;
+    ctx->relr_dyn_size = ctx->relr_entries_size * RELR_ENTRY_SIZE;
+}
 
-        buckets[bucket_index] = i + 1;
+// ld stores the address in .data as well when the relocation is relative,
+// which .relr.dyn relies on, since it has no addends
+static void init_relocation_addends(void) {
+    if (!ctx->is_symbolic) {
+        return;
     }
 
-    for (size_t i = 0; i < DEFAULT_SIZE; i++) {
-        u32 chain_index = buckets[i];
-        if (chain_index == 0) {
-            continue;
+    for (size_t i = 0; i < ctx->relocations_size; i++) {
+        u64 address = ctx->symbol_values[ctx->relocation_symbol_indices[i]];
+        u8 *operand = ctx->data_bytes + ctx->relocation_section_offsets[i];
+
+        for (size_t byte = 0; byte < 8; byte++) {
+            operand[byte] = address >> (byte * 8);
         }
+    }
+}
 
-        char *symbol = symbols[chain_index - 1];
+// ld moves the labels of an empty .text to the section before it,
+// unless the section after it starts at the same address
+// See _bfd_nearby_section() in https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/linker.c
+static u16 get_text_symbol_section_index(void) {
+    size_t next_section_offset = has_rodata() ? ctx->rodata_offset : ctx->eh_frame_offset;
+    if (!has_text() && ctx->text_offset < next_section_offset) {
+        return ctx->text_section_index - 1;
+    }
+    return ctx->text_section_index;
+}
 
-        shuffled_symbol_index_to_symbol_index[shuffled_symbols_size] = chain_index - 1;
+// .symtab and .dynsym both need these, so they are only computed once
+static void init_symbol_values(void) {
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        switch (ctx->symbol_sections[i]) {
+        case SECTION_TEXT:
+            ctx->symbol_section_indices[i] = get_text_symbol_section_index();
+            ctx->symbol_values[i] = ctx->text_offset + ctx->symbol_section_offsets[i];
+            break;
+        case SECTION_DATA:
+            ctx->symbol_section_indices[i] = ctx->data_section_index;
+            ctx->symbol_values[i] = ctx->data_address + ctx->symbol_section_offsets[i];
+            break;
+        case SECTION_RODATA:
+            ctx->symbol_section_indices[i] = ctx->rodata_section_index;
+            ctx->symbol_values[i] = ctx->rodata_offset + ctx->symbol_section_offsets[i];
+            break;
+        case SECTION_BSS:
+            ctx->symbol_section_indices[i] = ctx->bss_section_index;
+            ctx->symbol_values[i] = ctx->bss_address + ctx->symbol_section_offsets[i];
+            break;
+        }
+    }
+}
 
-        push_shuffled_symbol(symbol);
+// The sections are numbered in the order they appear in push_section_headers()
+static void init_section_header_indices(void) {
+    u16 index = 1; // Index 0 is the null section
 
-        while (true) {
-            chain_index = chains[chain_index];
-            if (chain_index == 0) {
-                break;
-            }
+    if (ctx->hash_style & HASH_STYLE_SYSV) {
+        ctx->hash_section_index = index++;
+    }
+    if (ctx->hash_style & HASH_STYLE_GNU) {
+        ctx->gnu_hash_section_index = index++;
+    }
+    ctx->dynsym_section_index = index++;
+    ctx->dynstr_section_index = index++;
+    if (ctx->relocations_size > 0) {
+        ctx->rela_dyn_section_index = index++;
+    }
+    if (ctx->relr_dyn_size > 0) {
+        ctx->relr_dyn_section_index = index++;
+    }
+    // An empty .text takes the index of the section after it, see get_text_symbol_section_index()
+    ctx->text_section_index = has_text() ? index++ : index;
+    if (has_rodata()) {
+        ctx->rodata_section_index = index++;
+    }
+    ctx->eh_frame_section_index = index++;
+    ctx->dynamic_section_index = index++;
+    if (has_data()) {
+        ctx->data_section_index = index++;
+    }
+    if (has_bss()) {
+        ctx->bss_section_index = index++;
+    }
+    if (has_symtab()) {
+        ctx->symtab_section_index = index++;
+        ctx->strtab_section_index = index++;
+    }
+    if (has_gnu_debuglink()) {
+        ctx->gnu_debuglink_section_index = index++;
+    }
+    ctx->shstrtab_section_index = index++;
 
-            symbol = symbols[chain_index - 1];
+    ctx->section_count = index;
+}
 
-            shuffled_symbol_index_to_symbol_index[shuffled_symbols_size] = chain_index - 1;
+// .gnu.hash requires the symbols of every bucket to be next to each other in .dynsym,
+// so they get sorted by bucket, while keeping their shuffled order within a bucket
+// See https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elflink.c#l6470
+static void sort_dynsym_by_gnu_hash_bucket(void) {
+    memset(ctx->gnu_hash_counts, 0, ctx->gnu_hash_nbucket * sizeof(u32));
 
-            push_shuffled_symbol(symbol);
-        }
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        ctx->gnu_hash_counts[get_symbol_gnu_hash(i) % ctx->gnu_hash_nbucket]++;
+    }
+
+    // Reusing the buckets array to hold the next free .dynsym slot of every bucket
+    u32 start = 0;
+    for (size_t i = 0; i < ctx->gnu_hash_nbucket; i++) {
+        ctx->buckets[i] = start;
+        start += ctx->gnu_hash_counts[i];
+    }
+
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        size_t symbol_index = ctx->shuffled_symbol_index_to_symbol_index[i];
+        u32 bucket_index = get_symbol_gnu_hash(symbol_index) % ctx->gnu_hash_nbucket;
+
+        ctx->dynsym_index_to_symbol_index[ctx->buckets[bucket_index]++] = symbol_index;
     }
 }
 
-static void init_symbol_name_dynstr_offsets(void) {
-    size_t offset = 1;
+// Tries every bucket count from a quarter up to twice the number of symbols,
+// and picks the one with the smallest sum of squared chain lengths,
+// where every page that the table spans multiplies the cost, so that it doesn't grow without bound
+// From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elflink.c#l6600
+static u32 get_optimized_nbucket(bool is_gnu_hash) {
+    u32 *hashes = is_gnu_hash ? ctx->symbol_gnu_hashes : ctx->symbol_elf_hashes;
 
-    static size_t parent_indices[MAX_SYMBOLS];
-    static size_t substr_offsets[MAX_SYMBOLS];
+    size_t nsyms = ctx->symbols_size;
 
-    memset(parent_indices, -1, symbols_size * sizeof(size_t));
+    size_t minsize = nsyms / 4;
+    if (minsize == 0) {
+        minsize = 1;
+    }
+    size_t maxsize = nsyms * 2;
+    size_t best_size = maxsize;
 
-    memset(is_substrs, false, symbols_size * sizeof(bool));
+    // .gnu.hash avoids bucket counts that are a multiple of 32, since its bloom filter words are
+    if (is_gnu_hash) {
+        if (minsize < 2) {
+            minsize = 2;
+        }
+        if ((best_size & 31) == 0) {
+            best_size++;
+        }
+    }
 
-    // This function could be optimized from O(n^2) to O(n) with a hash map
-    for (size_t i = 0; i < symbols_size; i++) {
-        char *symbol = symbols[i];
+    u32 *counts = ctx->buckets;
+    u64 best_cost = UINT64_MAX;
+    size_t tries_without_improvement = 0;
 
-        size_t parent_index;
-        size_t ending_index;
-        for (parent_index = 0; parent_index < symbols_size; parent_index++) {
-            if (i != parent_index) {
-                ending_index = get_ending_index(symbols[parent_index], symbol);
-                if (ending_index != (size_t)-1) {
-                    break;
-                }
-            }
+    for (size_t size = minsize; size < maxsize; size++) {
+        if (is_gnu_hash && (size & 31) == 0) {
+            continue;
+        }
+
+        memset(counts, 0, size * sizeof(u32));
+        for (size_t i = 0; i < nsyms; i++) {
+            counts[hashes[i] % size]++;
         }
 
-        // If symbol wasn't in the end of another symbol
-        bool is_substr = parent_index != symbols_size;
+        // The nbucket and nchain words, and a chain entry for every .dynsym entry
+        u64 cost = (2 + 1 + nsyms) * 4;
 
-        if (is_substr) {
-            parent_indices[i] = parent_index;
-            substr_offsets[i] = ending_index;
-        } else {
-            symbol_name_dynstr_offsets[i] = offset;
-            offset += strlen(symbol) + 1;
+        for (size_t i = 0; i < size; i++) {
+            cost += (u64)counts[i] * counts[i];
         }
 
-        is_substrs[i] = is_substr;
-    }
+        u64 pages = size / (PAGE_SIZE / 4) + 1;
+        cost *= pages * pages;
 
-    // Now that all the parents have been given final offsets in .dynstr,
-    // it is clear what index their substring symbols have
-    for (size_t i = 0; i < symbols_size; i++) {
-        size_t parent_index = parent_indices[i];
-        if (parent_index != (size_t)-1) {
-            size_t parent_offset = symbol_name_dynstr_offsets[parent_index];
-            symbol_name_dynstr_offsets[i] = parent_offset + substr_offsets[i];
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_size = size;
+            tries_without_improvement = 0;
+        } else if (++tries_without_improvement == MAX_BUCKET_COUNT_TRIES_WITHOUT_IMPROVEMENT) {
+            break;
         }
     }
-}
 
-static void push_symbol(char *symbol) {
-    if (symbols_size + 1 > MAX_SYMBOLS) {
-        fprintf(stderr, "error: MAX_SYMBOLS of %d was exceeded\n", MAX_SYMBOLS);
-        exit(EXIT_FAILURE);
+    // Only happens when there are no symbols
+    if (best_size == 0) {
+        best_size = 1;
     }
 
-    symbols[symbols_size++] = symbol;
+    return best_size;
 }
 
-static void reset(void) {
-    symbols_size = 0;
-    chains_size = 0;
-    shuffled_symbols_size = 0;
-    bytes_size = 0;
-}
+static size_t init_chain_length_counts(bool is_gnu_hash, u32 nbucket, u32 *chain_length_counts) {
+    u32 *hashes = is_gnu_hash ? ctx->symbol_gnu_hashes : ctx->symbol_elf_hashes;
 
-static void generate_simple_so(void) {
-    reset();
+    u32 *counts = ctx->buckets;
+    memset(counts, 0, nbucket * sizeof(u32));
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        counts[hashes[i] % nbucket]++;
+    }
 
-    // TODO: Use the symbols from the AST
-    push_symbol("define");
-    push_symbol("a");
-    push_symbol("b");
-    push_symbol("c");
-    push_symbol("d");
-    push_symbol("e");
-    push_symbol("f");
-    push_symbol("g");
-    push_symbol("h");
-    push_symbol("fn1_c");
-    push_symbol("fn2_c");
-
-    // TODO: Let this be gotten with push_text() calls
-    text_size = 12;
+    size_t chain_length_counts_size = 0;
+    for (size_t i = 0; i < nbucket; i++) {
+        while (counts[i] >= chain_length_counts_size) {
+            chain_length_counts[chain_length_counts_size++] = 0;
+        }
+        chain_length_counts[counts[i]]++;
+    }
 
-    init_symbol_name_dynstr_offsets();
+    return chain_length_counts_size;
+}
 
-    generate_shuffled_symbols();
+static void init_hash_nbuckets(void) {
+    ctx->has_chain_length_counts = ctx->stats_format != STATS_FORMAT_NONE;
 
-    init_symbol_name_strtab_offsets();
+    if (ctx->hash_style & HASH_STYLE_SYSV) {
+        ctx->hash_nbucket = ctx->optimize_hash_buckets ? get_optimized_nbucket(false) : get_nbucket();
+
+        if (ctx->stats_format != STATS_FORMAT_NONE) {
+            ctx->hash_chain_length_counts_size = init_chain_length_counts(false, ctx->hash_nbucket, ctx->hash_chain_length_counts);
+        }
+    }
 
-    init_data_offsets();
-    init_text_offsets();
+    if (ctx->hash_style & HASH_STYLE_GNU) {
+        ctx->gnu_hash_nbucket = ctx->optimize_hash_buckets ? get_optimized_nbucket(true) : get_nbucket();
 
-    push_bytes();
+        // ld never uses fewer than 2 buckets for .gnu.hash
+        if (ctx->gnu_hash_nbucket < 2) {
+            ctx->gnu_hash_nbucket = 2;
+        }
 
-    fix_bytes();
+        if (ctx->stats_format != STATS_FORMAT_NONE) {
+            ctx->gnu_hash_chain_length_counts_size = init_chain_length_counts(true, ctx->gnu_hash_nbucket, ctx->gnu_hash_chain_length_counts);
+        }
+    }
+}
 
-    FILE *f = fopen("full.so", "w");
-    if (!f) {
-        perror("fopen");
-        exit(EXIT_FAILURE);
+static void init_dynsym_order(void) {
+    if (ctx->hash_style & HASH_STYLE_GNU) {
+        sort_dynsym_by_gnu_hash_bucket();
+    } else {
+        memcpy(ctx->dynsym_index_to_symbol_index, ctx->shuffled_symbol_index_to_symbol_index, ctx->symbols_size * sizeof(u32));
+    }
+
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        ctx->symbol_index_to_dynsym_index[ctx->dynsym_index_to_symbol_index[i]] = i;
     }
-    fwrite(bytes, sizeof(u8), bytes_size, f);
-    fclose(f);
 }
 
-int main(void) {
-    generate_simple_so();
+// Orders symbol names by their reversed characters, so that a name is followed by every name it is a suffix of
+// The last character is compared first, and if one name is a suffix of the other, the shorter one comes first
+// From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elf-strtab.c#l304
+static int strrevcmp(const void *a, const void *b) {
+    u32 index_a = *(const u32 *)a;
+    u32 index_b = *(const u32 *)b;
+
+    size_t len_a = ctx->symbol_name_lengths[index_a];
+    size_t len_b = ctx->symbol_name_lengths[index_b];
+
+    const unsigned char *s = (const unsigned char *)ctx->symbols[index_a] + len_a;
+    const unsigned char *t = (const unsigned char *)ctx->symbols[index_b] + len_b;
+
+    size_t l = len_a < len_b ? len_a : len_b;
+
+    while (l > 0) {
+        s--;
+        t--;
+        if (*s != *t) {
+            return (int)*s - (int)*t;
+        }
+        l--;
+    }
+
+    if (len_a != len_b) {
+        return len_a < len_b ? -1 : 1;
+    }
+
+    // Keeps the order of duplicate names deterministic, since qsort() isn't stable
+    return index_a < index_b ? -1 : index_a > index_b;
+}
+
+// Whether `needle` is a suffix of the longer or equally long `haystack`
+static bool is_suffix(size_t haystack_index, size_t needle_index) {
+    size_t haystack_len = ctx->symbol_name_lengths[haystack_index];
+    size_t needle_len = ctx->symbol_name_lengths[needle_index];
+
+    if (needle_len > haystack_len) {
+        return false;
+    }
+
+    return memcmp(ctx->symbols[haystack_index] + haystack_len - needle_len, ctx->symbols[needle_index], needle_len) == 0;
+}
+
+// Figures out which symbol names can be stored at the end of another symbol name,
+// in the same way that ld does it in _bfd_elf_strtab_finalize():
+// https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elf-strtab.c#l395
+//
+// Example with the symbols "e", "define" and "fine":
+//
+// sorted by reversed name: "e", "define", "fine"
+//
+// Walking from the end, "fine" is not a suffix of anything after it, so it gets stored in the string table.
+// "define" is not a suffix of "fine", so it gets stored too, and "e" is a suffix of "define".
+//
+// Because every name is followed by the names it is a suffix of, the parent is always a symbol
+// that gets stored in full, which means this takes O(n log n) instead of O(n^2)
+static void init_is_substrs(void) {
+    u32 *sorted_indices = ctx->sorted_symbol_indices;
+
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        sorted_indices[i] = i;
+    }
+
+    qsort(sorted_indices, ctx->symbols_size, sizeof(u32), strrevcmp);
+
+    memset(ctx->is_substrs, false, ctx->symbols_size * sizeof(bool));
+
+    if (ctx->symbols_size == 0) {
+        return;
+    }
+
+    size_t parent_index = sorted_indices[ctx->symbols_size - 1];
+
+    for (size_t i = ctx->symbols_size - 1; i > 0; i--) {
+        size_t symbol_index = sorted_indices[i - 1];
+
+        if (is_suffix(parent_index, symbol_index)) {
+            ctx->is_substrs[symbol_index] = true;
+            ctx->parent_indices[symbol_index] = parent_index;
+        } else {
+            parent_index = symbol_index;
+        }
+    }
+}
+
+// Substring symbols point into the end of their parent symbol
+static u32 get_substr_offset(u32 *offsets, size_t symbol_index) {
+    size_t parent_index = ctx->parent_indices[symbol_index];
+    return offsets[parent_index] + ctx->symbol_name_lengths[parent_index] - ctx->symbol_name_lengths[symbol_index];
+}
+
+static void init_symbol_name_strtab_offsets(void) {
+    // The offsets are relative to the end of the local names
+    size_t offset = 0;
+
+    // The parents are pushed in shuffled order
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        size_t symbol_index = ctx->shuffled_symbol_index_to_symbol_index[i];
+
+        if (!ctx->is_substrs[symbol_index]) {
+            ctx->symbol_name_strtab_offsets[symbol_index] = offset;
+            offset += ctx->symbol_name_lengths[symbol_index] + 1;
+        }
+    }
+
+    ctx->strtab_local_names_size = 1 + ctx->source_path_length + 1 + sizeof("_DYNAMIC");
+    ctx->strtab_size = ctx->strtab_local_names_size + offset;
+
+    // Now that all the parents have been given final offsets in .strtab,
+    // it is clear what index their substring symbols have
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        if (ctx->is_substrs[i]) {
+            ctx->symbol_name_strtab_offsets[i] = get_substr_offset(ctx->symbol_name_strtab_offsets, i);
+        }
+    }
+}
+
+static void push_shuffled_symbol(u32 symbol_index) {
+    if (ctx->shuffled_symbols_size + 1 > MAX_SYMBOLS) {
+        fprintf(stderr, "error: MAX_SYMBOLS of %d was exceeded\n", MAX_SYMBOLS);
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->shuffled_symbol_index_to_symbol_index[ctx->shuffled_symbols_size++] = symbol_index;
+}
+
+// This is solely here to put the symbols in the same weird order as ld does
+// From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/hash.c#l508
+static unsigned long bfd_hash_hash(const char *string, unsigned int len) {
+    const unsigned char *s;
+    unsigned long hash;
+    unsigned int c;
+
+    hash = 0;
+    s = (const unsigned char *) string;
+    for (unsigned int i = 0; i < len; i++) {
+        c = s[i];
+        hash += c + (c << 17);
+        hash ^= hash >> 2;
+    }
+    hash += len + (len << 17);
+    hash ^= hash >> 2;
+    return hash;
+}
+
+// From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/hash.c#l391
+static unsigned long get_higher_prime_number(unsigned long n) {
+    static const unsigned long primes[] = {
+        31, 61, 127, 251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521,
+        131071, 262139, 524287, MAX_BFD_HASH_SIZE,
+    };
+
+    for (size_t i = 0; i < sizeof(primes) / sizeof(*primes); i++) {
+        if (primes[i] > n) {
+            return primes[i];
+        }
+    }
+
+    fprintf(stderr, "error: MAX_BFD_HASH_SIZE of %d was exceeded\n", MAX_BFD_HASH_SIZE);
+    exit(EXIT_FAILURE);
+}
+
+// Hashes HASH_LANES symbols at once, with the lanes interleaved byte by byte
+// Every hash step depends on the previous one, so hashing a single name can't use more than one ALU,
+// while the independent lanes can, and GCC turns the lanes into SIMD instructions where it can
+// The elf_hash(), bfd_elf_gnu_hash() and bfd_hash_hash() steps also share the loads of the bytes
+static void hash_symbol_lanes(size_t first_symbol_index) {
+    const unsigned char *names[HASH_LANES];
+    u32 lengths[HASH_LANES];
+    u32 elf_hashes[HASH_LANES];
+    u32 gnu_hashes[HASH_LANES];
+    unsigned long bfd_hashes[HASH_LANES];
+
+    u32 max_length = 0;
+    for (size_t lane = 0; lane < HASH_LANES; lane++) {
+        size_t symbol_index = first_symbol_index + lane;
+        names[lane] = (const unsigned char *)ctx->symbols[symbol_index];
+        lengths[lane] = ctx->symbol_name_lengths[symbol_index];
+        if (lengths[lane] > max_length) {
+            max_length = lengths[lane];
+        }
+
+        elf_hashes[lane] = 0;
+        gnu_hashes[lane] = 5381;
+        bfd_hashes[lane] = 0;
+    }
+
+    for (u32 i = 0; i < max_length; i++) {
+        for (size_t lane = 0; lane < HASH_LANES; lane++) {
+            // Lanes whose name has ended keep their hashes, and don't read past their name
+            bool is_active = i < lengths[lane];
+            u32 c = is_active ? names[lane][i] : 0;
+
+            u32 elf_hash = (elf_hashes[lane] << 4) + c;
+            elf_hash ^= (elf_hash >> 24) & 0xf0;
+            elf_hashes[lane] = is_active ? elf_hash : elf_hashes[lane];
+
+            u32 gnu_hash = (gnu_hashes[lane] << 5) + gnu_hashes[lane] + c;
+            gnu_hashes[lane] = is_active ? gnu_hash : gnu_hashes[lane];
+
+            unsigned long bfd_hash = bfd_hashes[lane] + c + (c << 17);
+            bfd_hash ^= bfd_hash >> 2;
+            bfd_hashes[lane] = is_active ? bfd_hash : bfd_hashes[lane];
+        }
+    }
+
+    for (size_t lane = 0; lane < HASH_LANES; lane++) {
+        size_t symbol_index = first_symbol_index + lane;
+
+        ctx->symbol_elf_hashes[symbol_index] = elf_hashes[lane] & 0x0fffffff;
+        ctx->symbol_gnu_hashes[symbol_index] = gnu_hashes[lane];
+
+        unsigned long bfd_hash = bfd_hashes[lane];
+        bfd_hash += lengths[lane] + ((unsigned long)lengths[lane] << 17);
+        bfd_hash ^= bfd_hash >> 2;
+        ctx->symbol_bfd_hashes[symbol_index] = bfd_hash;
+    }
+}
+
+// The start and end have to be a multiple of HASH_LANES, except for the end of the last range
+static void hash_symbol_range(size_t start, size_t end) {
+    size_t i = start;
+
+    for (; i + HASH_LANES <= end; i += HASH_LANES) {
+        hash_symbol_lanes(i);
+    }
+
+    for (; i < end; i++) {
+        ctx->symbol_elf_hashes[i] = elf_hash(ctx->symbols[i], ctx->symbol_name_lengths[i]);
+        ctx->symbol_gnu_hashes[i] = bfd_elf_gnu_hash(ctx->symbols[i], ctx->symbol_name_lengths[i]);
+        ctx->symbol_bfd_hashes[i] = bfd_hash_hash(ctx->symbols[i], ctx->symbol_name_lengths[i]);
+    }
+}
+
+struct hash_thread {
+    struct context *ctx;
+    size_t start;
+    size_t end;
+};
+
+static void *run_hash_thread(void *arg) {
+    struct hash_thread *hash_thread = arg;
+
+    // Every thread writes to its own range of the hash arrays, so they can share the context
+    ctx = hash_thread->ctx;
+    hash_symbol_range(hash_thread->start, hash_thread->end);
+
+    return NULL;
+}
+
+// Computes the three hashes that the later phases need of every symbol,
+// spreading the symbols over threads once there are enough of them to be worth it
+static void hash_symbols(void) {
+    size_t thread_count = ctx->symbols_size / MIN_SYMBOLS_PER_HASH_THREAD;
+    if (thread_count > (size_t)ctx->hash_thread_count) {
+        thread_count = ctx->hash_thread_count;
+    }
+    if (thread_count > MAX_HASH_THREADS) {
+        thread_count = MAX_HASH_THREADS;
+    }
+    if (thread_count <= 1) {
+        hash_symbol_range(0, ctx->symbols_size);
+        return;
+    }
+
+    pthread_t threads[MAX_HASH_THREADS];
+    struct hash_thread hash_threads[MAX_HASH_THREADS];
+
+    size_t symbols_per_thread = ctx->symbols_size / thread_count / HASH_LANES * HASH_LANES;
+
+    for (size_t i = 0; i < thread_count; i++) {
+        hash_threads[i].ctx = ctx;
+        hash_threads[i].start = i * symbols_per_thread;
+        hash_threads[i].end = i + 1 == thread_count ? ctx->symbols_size : (i + 1) * symbols_per_thread;
+    }
+
+    // The calling thread hashes the first range itself
+    for (size_t i = 1; i < thread_count; i++) {
+        int err = pthread_create(&threads[i], NULL, run_hash_thread, &hash_threads[i]);
+        if (err != 0) {
+            fprintf(stderr, "error: pthread_create: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    hash_symbol_range(hash_threads[0].start, hash_threads[0].end);
+
+    for (size_t i = 1; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// See the documentation of push_hash() for how this function roughly works
+//
+// name | index
+// "a"  | 3485
+// "b"  |  245
+// "c"  | 2224
+// "d"  | 2763
+// "e"  | 3574
+// "f"  |  553
+// "g"  |  872
+// "h"  | 3042
+// "i"  | 1868
+// "j"  |  340
+// "k"  | 1151
+// "l"  | 1146
+// "m"  | 3669
+// "n"  |  429
+// "o"  |  967
+// "p"  |  256
+//
+// This gets shuffled by ld to this:
+// (see https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/hash.c#l618)
+// "b"
+// "p"
+// "j"
+// "n"
+// "f"
+// "g"
+// "o"
+// "l"
+// "k"
+// "i"
+// "c"
+// "d"
+// "h"
+// "a"
+// "e"
+// "m"
+static void generate_shuffled_symbols(void) {
+    unsigned long *hashes = ctx->symbol_bfd_hashes;
+
+    u32 *table = ctx->bfd_hash_table_a;
+    u32 *new_table = ctx->bfd_hash_table_b;
+    unsigned long size = BFD_HASH_DEFAULT_SIZE;
+    size_t count = BFD_HASH_PRESENT_ENTRIES;
+
+    memset(table, 0, size * sizeof(u32));
+
+    ctx->chains_size = 0;
+
+    push_chain(0); // The first entry in the chain is always STN_UNDEF
+
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        unsigned long hash = hashes[i];
+
+        u32 bucket_index = hash % size;
+
+        push_chain(table[bucket_index]);
+
+        table[bucket_index] = i + 1;
+
+        count++;
+
+        // ld grows its table once it is over 3/4 full, which reshuffles the symbols
+        // From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/hash.c#l566
+        if (count > size * 3 / 4) {
+            unsigned long new_size = get_higher_prime_number(size);
+
+            memset(new_table, 0, new_size * sizeof(u32));
+
+            for (unsigned long hi = 0; hi < size; hi++) {
+                while (table[hi] != 0) {
+                    u32 chain = table[hi];
+
+                    // Runs of symbols with the same hash are moved together, so they keep their order
+                    u32 chain_end = chain;
+                    while (ctx->chains[chain_end] != 0 && hashes[ctx->chains[chain_end] - 1] == hashes[chain - 1]) {
+                        chain_end = ctx->chains[chain_end];
+                    }
+
+                    table[hi] = ctx->chains[chain_end];
+
+                    u32 new_bucket_index = hashes[chain - 1] % new_size;
+                    ctx->chains[chain_end] = new_table[new_bucket_index];
+                    new_table[new_bucket_index] = chain;
+                }
+            }
+
+            u32 *old_table = table;
+            table = new_table;
+            new_table = old_table;
+            size = new_size;
+        }
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        u32 chain_index = table[i];
+        if (chain_index == 0) {
+            continue;
+        }
+
+        push_shuffled_symbol(chain_index - 1);
+
+        while (true) {
+            chain_index = ctx->chains[chain_index];
+            if (chain_index == 0) {
+                break;
+            }
+
+            push_shuffled_symbol(chain_index - 1);
+        }
+    }
+}
+
+static void init_symbol_name_dynstr_offsets(void) {
+    size_t offset = 1;
+
+    // The parents are pushed in symbols order
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        if (!ctx->is_substrs[i]) {
+            ctx->symbol_name_dynstr_offsets[i] = offset;
+            offset += ctx->symbol_name_lengths[i] + 1;
+        }
+    }
+
+    ctx->dynstr_size = offset;
+
+    // Now that all the parents have been given final offsets in .dynstr,
+    // it is clear what index their substring symbols have
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        if (ctx->is_substrs[i]) {
+            ctx->symbol_name_dynstr_offsets[i] = get_substr_offset(ctx->symbol_name_dynstr_offsets, i);
+        }
+    }
+}
+
+static void push_symbol(char *name, size_t name_length, enum section section, size_t section_offset) {
+    if (ctx->symbols_size + 1 > MAX_SYMBOLS) {
+        fprintf(stderr, "error: MAX_SYMBOLS of %d was exceeded\n", MAX_SYMBOLS);
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->symbols[ctx->symbols_size] = name;
+    ctx->symbol_name_lengths[ctx->symbols_size] = name_length;
+    ctx->symbol_sections[ctx->symbols_size] = section;
+    ctx->symbol_section_offsets[ctx->symbols_size] = section_offset;
+    ctx->symbols_size++;
+}
+
+static void parse_error(char *format, ...) {
+    fprintf(stderr, "error: %s:%zu: ", ctx->source_path, ctx->line_number);
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+static void map_source(void) {
+    int fd = open(ctx->source_path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    ctx->source_size = st.st_size;
+
+    // mmap() refuses to map 0 bytes
+    if (ctx->source_size == 0) {
+        ctx->source = "";
+    } else {
+        ctx->source = mmap(NULL, ctx->source_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ctx->source == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    close(fd);
+}
+
+// The symbol names point into the mapping, so this may only be called once the .so has been written
+static void unmap_source(void) {
+    if (ctx->source_size > 0 && munmap(ctx->source, ctx->source_size) == -1) {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Returns the slot that holds the global with this name, or the empty slot it would go in
+static u32 *get_global_slot(char *name, size_t name_length) {
+    u32 slot_index = bfd_elf_gnu_hash(name, name_length) & (GLOBALS_TABLE_SIZE - 1);
+
+    while (true) {
+        u32 *slot = &ctx->globals_table[slot_index];
+
+        if (*slot == 0) {
+            return slot;
+        }
+
+        size_t global_index = *slot - 1;
+        if (ctx->global_name_lengths[global_index] == name_length && memcmp(ctx->global_names[global_index], name, name_length) == 0) {
+            return slot;
+        }
+
+        slot_index = (slot_index + 1) & (GLOBALS_TABLE_SIZE - 1);
+    }
+}
+
+static void declare_global(char *name, size_t name_length) {
+    u32 *slot = get_global_slot(name, name_length);
+
+    // NASM allows declaring a global more than once
+    if (*slot != 0) {
+        return;
+    }
+
+    if (ctx->globals_size + 1 > MAX_SYMBOLS) {
+        fprintf(stderr, "error: MAX_SYMBOLS of %d was exceeded\n", MAX_SYMBOLS);
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->global_names[ctx->globals_size] = name;
+    ctx->global_name_lengths[ctx->globals_size] = name_length;
+    ctx->is_global_defined[ctx->globals_size] = false;
+    ctx->globals_size++;
+
+    *slot = ctx->globals_size;
+}
+
+// Appends `count` uninitialized bytes to the section that is being assembled into
+static u8 *grow_section_bytes(size_t count) {
+    if (ctx->current_section == SECTION_BSS) {
+        parse_error("Only resb, resw, resd and resq are supported in .bss, since it has no bytes to initialize");
+    }
+
+    u8 **section_bytes = &ctx->text_bytes;
+    size_t *size = &ctx->text_size;
+    size_t *capacity = &ctx->text_capacity;
+    if (ctx->current_section == SECTION_DATA) {
+        section_bytes = &ctx->data_bytes;
+        size = &ctx->data_size;
+        capacity = &ctx->data_capacity;
+    } else if (ctx->current_section == SECTION_RODATA) {
+        section_bytes = &ctx->rodata_bytes;
+        size = &ctx->rodata_size;
+        capacity = &ctx->rodata_capacity;
+    }
+
+    if (*size + count > *capacity) {
+        size_t new_capacity = *capacity > 0 ? *capacity : MIN_BYTES_CAPACITY;
+        while (new_capacity < *size + count) {
+            new_capacity *= 2;
+        }
+
+        u8 *new_bytes = realloc(*section_bytes, new_capacity);
+        if (!new_bytes) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+
+        *section_bytes = new_bytes;
+        *capacity = new_capacity;
+    }
+
+    u8 *start = *section_bytes + *size;
+    *size += count;
+    return start;
+}
+
+static size_t get_section_size(void) {
+    if (ctx->current_section == SECTION_DATA) {
+        return ctx->data_size;
+    }
+    if (ctx->current_section == SECTION_RODATA) {
+        return ctx->rodata_size;
+    }
+    if (ctx->current_section == SECTION_BSS) {
+        return ctx->bss_size;
+    }
+    return ctx->text_size;
+}
+
+static void assemble_byte(u8 byte) {
+    *grow_section_bytes(1) = byte;
+}
+
+static void assemble_u32(u32 n) {
+    store_u32(grow_section_bytes(4), n);
+}
+
+static void assemble_u64(u64 n) {
+    store_u64(grow_section_bytes(8), n);
+}
+
+// Only stores the low `size` bytes of `n`, just like NASM does for `db 0x1337`
+static void assemble_number(u64 n, size_t size) {
+    u8 *dest = grow_section_bytes(size);
+    for (size_t i = 0; i < size; i++) {
+        dest[i] = n >> (i * 8);
+    }
+}
+
+static void define_label(char *name, size_t name_length) {
+    u32 *slot = get_global_slot(name, name_length);
+    if (*slot == 0) {
+        parse_error("The label '%.*s' isn't declared global, and local labels aren't supported", (int)name_length, name);
+    }
+
+    size_t global_index = *slot - 1;
+    if (ctx->is_global_defined[global_index]) {
+        parse_error("The label '%.*s' is defined more than once", (int)name_length, name);
+    }
+    ctx->is_global_defined[global_index] = true;
+    ctx->global_symbol_indices[global_index] = ctx->symbols_size;
+
+    bool is_aligned = ctx->current_section == SECTION_TEXT && ctx->text_size == ctx->last_text_alignment_offset;
+    ctx->symbol_alignments[ctx->symbols_size] = is_aligned ? ctx->last_text_alignment : 1;
+    ctx->symbol_paddings[ctx->symbols_size] = is_aligned ? ctx->text_size - ctx->last_text_alignment_start : 0;
+
+    if (ctx->current_section == SECTION_DATA) {
+        ctx->has_data_labels = true;
+    } else if (ctx->current_section == SECTION_RODATA) {
+        ctx->has_rodata_labels = true;
+    } else if (ctx->current_section == SECTION_BSS) {
+        ctx->has_bss_labels = true;
+    }
+
+    push_symbol(name, name_length, ctx->current_section, get_section_size());
+}
+
+static bool is_at_line_end(void) {
+    return ctx->cursor == ctx->source_end || *ctx->cursor == '\n' || *ctx->cursor == ';';
+}
+
+static void skip_spaces(void) {
+    while (ctx->cursor < ctx->source_end && (*ctx->cursor == ' ' || *ctx->cursor == '\t' || *ctx->cursor == '\r')) {
+        ctx->cursor++;
+    }
+}
+
+static bool is_identifier_start(char c) {
+    return isalpha((unsigned char)c) || c == '_' || c == '.' || c == '?';
+}
+
+static bool is_identifier_char(char c) {
+    return isalnum((unsigned char)c) || c == '_' || c == '.' || c == '?' || c == '$' || c == '#' || c == '@' || c == '~';
+}
+
+// Returns false when the cursor isn't at an identifier
+static bool parse_identifier(char **name, size_t *name_length) {
+    skip_spaces();
+
+    if (ctx->cursor == ctx->source_end || !is_identifier_start(*ctx->cursor)) {
+        return false;
+    }
+
+    *name = ctx->cursor;
+    while (ctx->cursor < ctx->source_end && is_identifier_char(*ctx->cursor)) {
+        ctx->cursor++;
+    }
+    *name_length = ctx->cursor - *name;
+
+    return true;
+}
+
+static void expect_identifier(char **name, size_t *name_length) {
+    if (!parse_identifier(name, name_length)) {
+        parse_error("Expected an identifier");
+    }
+}
+
+// NASM keywords and register names are case-insensitive
+static bool is_keyword(char *name, size_t name_length, char *keyword) {
+    return strlen(keyword) == name_length && strncasecmp(name, keyword, name_length) == 0;
+}
+
+static bool parse_comma(void) {
+    skip_spaces();
+
+    if (ctx->cursor < ctx->source_end && *ctx->cursor == ',') {
+        ctx->cursor++;
+        return true;
+    }
+
+    return false;
+}
+
+static void expect_comma(void) {
+    if (!parse_comma()) {
+        parse_error("Expected a ','");
+    }
+}
+
+static int get_digit_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return 16;
+}
+
+// Parses a decimal or 0x-prefixed hexadecimal number, which may be negated
+static u64 parse_number(void) {
+    skip_spaces();
+
+    bool is_negative = ctx->cursor < ctx->source_end && *ctx->cursor == '-';
+    if (is_negative) {
+        ctx->cursor++;
+    }
+
+    int base = 10;
+    if (ctx->source_end - ctx->cursor > 2 && ctx->cursor[0] == '0' && (ctx->cursor[1] == 'x' || ctx->cursor[1] == 'X')) {
+        base = 16;
+        ctx->cursor += 2;
+    }
+
+    char *digits = ctx->cursor;
+    u64 n = 0;
+    while (ctx->cursor < ctx->source_end && get_digit_value(*ctx->cursor) < base) {
+        n = n * base + get_digit_value(*ctx->cursor);
+        ctx->cursor++;
+    }
+
+    if (ctx->cursor == digits || (ctx->cursor < ctx->source_end && is_identifier_char(*ctx->cursor))) {
+        parse_error("Expected a number");
+    }
+
+    return is_negative ? -n : n;
+}
+
+static void assemble_string(size_t size) {
+    if (size != 1) {
+        parse_error("Strings are only supported by db");
+    }
+
+    char quote = *ctx->cursor++;
+
+    char *string = ctx->cursor;
+    while (ctx->cursor < ctx->source_end && *ctx->cursor != quote && *ctx->cursor != '\n') {
+        ctx->cursor++;
+    }
+    if (ctx->cursor == ctx->source_end || *ctx->cursor != quote) {
+        parse_error("Unterminated string");
+    }
+
+    size_t length = ctx->cursor - string;
+    memcpy(grow_section_bytes(length), string, length);
+
+    ctx->cursor++;
+}
+
+static void push_relocation(char *name, size_t name_length, size_t section_offset) {
+    if (ctx->relocations_size + 1 > MAX_RELOCATIONS) {
+        fprintf(stderr, "error: MAX_RELOCATIONS of %d was exceeded\n", MAX_RELOCATIONS);
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->relocation_names[ctx->relocations_size] = name;
+    ctx->relocation_name_lengths[ctx->relocations_size] = name_length;
+    ctx->relocation_section_offsets[ctx->relocations_size] = section_offset;
+    ctx->relocations_size++;
+}
+
+// The address of a label is only known once the .so has been loaded,
+// so the operand stays 0 until the dynamic linker relocates it
+// The label may be defined further down, so it is only looked up at the end of parse_source()
+static void assemble_label_address(size_t size) {
+    char *name;
+    size_t name_length;
+    expect_identifier(&name, &name_length);
+
+    if (size != 8) {
+        parse_error("Only dq can hold the address of '%.*s'", (int)name_length, name);
+    }
+    if (ctx->current_section != SECTION_DATA) {
+        parse_error("The address of '%.*s' can only be stored in .data, since .text and .rodata aren't writable", (int)name_length, name);
+    }
+
+    push_relocation(name, name_length, get_section_size());
+    assemble_u64(0);
+}
+
+// Reserves `count` uninitialized items of `size` bytes,
+// which only take up room in the file outside of .bss, where NASM zeros them
+static void assemble_reserve(size_t size) {
+    u64 count = parse_number();
+
+    // The symbol values are 32-bit, see push_symbol_entry()
+    if (count > (UINT32_MAX - get_section_size()) / size) {
+        parse_error("Reserving %llu times %zu bytes makes the section larger than 4 GiB", (unsigned long long)count, size);
+    }
+
+    if (ctx->current_section == SECTION_BSS) {
+        ctx->bss_size += count * size;
+    } else {
+        memset(grow_section_bytes(count * size), 0, count * size);
+    }
+}
+
+// Assembles the comma-separated operands of db, dw, dd and dq
+static void assemble_data(size_t size) {
+    do {
+        skip_spaces();
+
+        if (ctx->cursor < ctx->source_end && (*ctx->cursor == '"' || *ctx->cursor == '\'')) {
+            assemble_string(size);
+        } else if (ctx->cursor < ctx->source_end && is_identifier_start(*ctx->cursor)) {
+            assemble_label_address(size);
+        } else {
+            assemble_number(parse_number(), size);
+        }
+    } while (parse_comma());
+}
+
+// Returns the register its number in the ModR/M and opcode encodings, where r8 to r15 need REX.B
+static u8 expect_register(void) {
+    static char *registers[] = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+    };
+
+    char *name;
+    size_t name_length;
+    expect_identifier(&name, &name_length);
+
+    for (u8 i = 0; i < sizeof(registers) / sizeof(*registers); i++) {
+        if (is_keyword(name, name_length, registers[i])) {
+            return i;
+        }
+    }
+
+    parse_error("Expected a 64-bit register, but got '%.*s'", (int)name_length, name);
+    return 0;
+}
+
+// Picks the same encoding as NASM its default optimization level does
+// See https://www.felixcloutier.com/x86/mov
+static void assemble_mov(void) {
+    u8 reg = expect_register();
+    expect_comma();
+    u64 imm = parse_number();
+
+    u8 rex_b = reg >> 3;
+    u8 low_bits = reg & 7;
+
+    if (imm <= UINT32_MAX) {
+        // mov r32, imm32, which zero-extends into the full register
+        if (rex_b) {
+            assemble_byte(0x41);
+        }
+        assemble_byte(0xb8 + low_bits);
+        assemble_u32(imm);
+    } else if ((i64)imm >= INT32_MIN && (i64)imm <= INT32_MAX) {
+        // mov r/m64, imm32, which sign-extends into the full register
+        assemble_byte(0x48 | rex_b);
+        assemble_byte(0xc7);
+        assemble_byte(0xc0 + low_bits);
+        assemble_u32(imm);
+    } else {
+        // mov r64, imm64
+        assemble_byte(0x48 | rex_b);
+        assemble_byte(0xb8 + low_bits);
+        assemble_u64(imm);
+    }
+}
+
+// Pads to a multiple of the alignment, which has to be a power of 2 up to a page
+static void assemble_align(void) {
+    u64 alignment = parse_number();
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > PAGE_SIZE) {
+        parse_error("The alignment has to be a power of 2 up to %d, but got %llu", PAGE_SIZE, (unsigned long long)alignment);
+    }
+    if (ctx->current_section != SECTION_TEXT) {
+        parse_error("align is only supported in .text");
+    }
+
+    // Consecutive `align` directives all apply to the label after them
+    if (ctx->text_size == ctx->last_text_alignment_offset) {
+        if (ctx->last_text_alignment > alignment) {
+            alignment = ctx->last_text_alignment;
+        }
+    } else {
+        ctx->last_text_alignment_start = ctx->text_size;
+    }
+
+    size_t padding = align_up(ctx->text_size, alignment) - ctx->text_size;
+    store_nops(grow_section_bytes(padding), padding);
+
+    ctx->last_text_alignment = alignment;
+    ctx->last_text_alignment_offset = ctx->text_size;
+
+    if (alignment > ctx->text_alignment) {
+        ctx->text_alignment = alignment;
+    }
+}
+
+static void parse_section(void) {
+    char *name;
+    size_t name_length;
+    expect_identifier(&name, &name_length);
+
+    if (name_length == sizeof(".data") - 1 && memcmp(name, ".data", name_length) == 0) {
+        ctx->current_section = SECTION_DATA;
+    } else if (name_length == sizeof(".rodata") - 1 && memcmp(name, ".rodata", name_length) == 0) {
+        ctx->current_section = SECTION_RODATA;
+    } else if (name_length == sizeof(".bss") - 1 && memcmp(name, ".bss", name_length) == 0) {
+        ctx->current_section = SECTION_BSS;
+    } else if (name_length == sizeof(".text") - 1 && memcmp(name, ".text", name_length) == 0) {
+        ctx->current_section = SECTION_TEXT;
+    } else {
+        parse_error("Only the sections .data, .rodata, .bss and .text are supported, but got '%.*s'", (int)name_length, name);
+    }
+}
+
+static void parse_global(void) {
+    do {
+        char *name;
+        size_t name_length;
+        expect_identifier(&name, &name_length);
+
+        declare_global(name, name_length);
+    } while (parse_comma());
+}
+
+static void parse_instruction(char *name, size_t name_length) {
+    if (is_keyword(name, name_length, "db")) {
+        assemble_data(1);
+    } else if (is_keyword(name, name_length, "dw")) {
+        assemble_data(2);
+    } else if (is_keyword(name, name_length, "dd")) {
+        assemble_data(4);
+    } else if (is_keyword(name, name_length, "dq")) {
+        assemble_data(8);
+    } else if (is_keyword(name, name_length, "resb")) {
+        assemble_reserve(1);
+    } else if (is_keyword(name, name_length, "resw")) {
+        assemble_reserve(2);
+    } else if (is_keyword(name, name_length, "resd")) {
+        assemble_reserve(4);
+    } else if (is_keyword(name, name_length, "resq")) {
+        assemble_reserve(8);
+    } else if (is_keyword(name, name_length, "align")) {
+        assemble_align();
+    } else if (is_keyword(name, name_length, "mov")) {
+        assemble_mov();
+    } else if (is_keyword(name, name_length, "ret")) {
+        assemble_byte(0xc3);
+    } else {
+        parse_error("Unsupported instruction '%.*s'", (int)name_length, name);
+    }
+}
+
+static void parse_line(void) {
+    char *name;
+    size_t name_length;
+    if (!parse_identifier(&name, &name_length)) {
+        return;
+    }
+
+    if (is_keyword(name, name_length, "global")) {
+        parse_global();
+        return;
+    }
+    if (is_keyword(name, name_length, "section")) {
+        parse_section();
+        return;
+    }
+
+    if (ctx->cursor < ctx->source_end && *ctx->cursor == ':') {
+        ctx->cursor++;
+        define_label(name, name_length);
+
+        // An instruction is allowed to follow the label on the same line
+        if (!parse_identifier(&name, &name_length)) {
+            return;
+        }
+    }
+
+    parse_instruction(name, name_length);
+}
+
+// Adds the samples to the label with this name, when the source defines it
+static void add_samples(char *name, size_t name_length, u64 sample_count) {
+    u32 slot = *get_global_slot(name, name_length);
+    if (slot != 0) {
+        ctx->symbol_sample_counts[ctx->global_symbol_indices[slot - 1]] += sample_count;
+    }
+}
+
+// Finds the symbol of a stack frame in a line of `perf script` output,
+// which looks like "7f3a9c0011f6 fn_12+0x6 (/tmp/full.so)"
+// Returns false when the line doesn't hold a frame
+static bool parse_perf_frame(char *line, char **name, size_t *name_length) {
+    char *dso = strstr(line, " (");
+    if (!dso) {
+        return false;
+    }
+
+    char *start = dso;
+    while (start > line && start[-1] != ' ' && start[-1] != '\t') {
+        start--;
+    }
+    if (start == dso) {
+        return false;
+    }
+
+    // Drops the "+0x6" offset into the function
+    char *end = dso;
+    for (char *c = start; c < dso; c++) {
+        if (c[0] == '+' && c[1] == '0' && c[2] == 'x') {
+            end = c;
+        }
+    }
+
+    *name = start;
+    *name_length = end - start;
+    return true;
+}
+
+// Returns whether the line is "<name> <sample count>", and parses it
+static bool parse_sample_count_line(char *line, char **name, size_t *name_length, u64 *sample_count) {
+    char *save_ptr;
+    char *name_token = strtok_r(line, " \t\r\n", &save_ptr);
+    char *count_token = strtok_r(NULL, " \t\r\n", &save_ptr);
+    if (!name_token || !count_token || strtok_r(NULL, " \t\r\n", &save_ptr)) {
+        return false;
+    }
+
+    char *count_end;
+    *sample_count = strtoull(count_token, &count_end, 10);
+    if (*count_end != '\0' || !isdigit((unsigned char)count_token[0])) {
+        return false;
+    }
+
+    *name = name_token;
+    *name_length = strlen(name_token);
+    return true;
+}
+
+static bool is_blank_or_comment(char *line) {
+    line += strspn(line, " \t\r\n");
+    return *line == '\0' || *line == '#';
+}
+
+// Reads how hot every label is from either a list of "<name> <sample count>" lines,
+// or from the output of `perf script`, where every sample counts towards the function it was taken in
+// The format is decided by the first line that isn't blank or a comment
+static void read_profile(void) {
+    memset(ctx->symbol_sample_counts, 0, ctx->symbols_size * sizeof(*ctx->symbol_sample_counts));
+
+    FILE *f = fopen(ctx->profile_path, "r");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    size_t line_number = 0;
+
+    bool is_format_known = false;
+    bool is_perf_script = false;
+
+    // With `perf record -g` the frames of a sample follow its header line, and only the first one is where it was taken
+    bool is_waiting_for_frame = false;
+
+    while (getline(&line, &line_capacity, f) != -1) {
+        line_number++;
+
+        if (is_blank_or_comment(line)) {
+            continue;
+        }
+
+        char *name;
+        size_t name_length;
+        u64 sample_count;
+
+        if (!is_format_known) {
+            char *line_copy = strdup(line);
+            if (!line_copy) {
+                perror("strdup");
+                exit(EXIT_FAILURE);
+            }
+            is_perf_script = !parse_sample_count_line(line_copy, &name, &name_length, &sample_count);
+            free(line_copy);
+            is_format_known = true;
+        }
+
+        if (!is_perf_script) {
+            if (!parse_sample_count_line(line, &name, &name_length, &sample_count)) {
+                fprintf(stderr, "error: %s:%zu: Expected \"<name> <sample count>\"\n", ctx->profile_path, line_number);
+                exit(EXIT_FAILURE);
+            }
+            add_samples(name, name_length, sample_count);
+            continue;
+        }
+
+        if (line[0] != ' ' && line[0] != '\t') {
+            is_waiting_for_frame = true;
+        }
+        if (is_waiting_for_frame && parse_perf_frame(line, &name, &name_length)) {
+            add_samples(name, name_length, 1);
+            is_waiting_for_frame = false;
+        }
+    }
+
+    free(line);
+    fclose(f);
+}
+
+// A function of .text runs from a label up to the next label at a higher offset,
+// so labels at the same offset move together
+struct text_function {
+    u32 offset;
+    u32 new_offset;
+    u32 size;
+    u32 alignment;
+    u32 padding; // The NOPs that `align` put in front of it, which get redone
+    u64 sample_count;
+    u32 first_symbol_index; // Of the labels at this offset, in definition order
+    u32 symbols_size;
+};
+
+// Puts hotter functions first, and keeps the source order of functions that are equally hot
+static int compare_text_functions(const void *a, const void *b) {
+    const struct text_function *function_a = a;
+    const struct text_function *function_b = b;
+
+    if (function_a->sample_count != function_b->sample_count) {
+        return function_a->sample_count > function_b->sample_count ? -1 : 1;
+    }
+    return (function_a->offset > function_b->offset) - (function_a->offset < function_b->offset);
+}
+
+// Moves the hot functions of .text to the front with --profile, in order of how hot they are, so they share as few pages as possible,
+// and pads every function with NOPs up to --align-functions, or the `align` right before it when that is more
+// This is safe because nothing in .text refers to an address in .text
+static void layout_text_functions(void) {
+    // The labels of .text are defined in order of increasing offset
+    u32 *text_symbol_indices = malloc(ctx->symbols_size * sizeof(u32));
+    struct text_function *functions = malloc(ctx->symbols_size * sizeof(struct text_function));
+    if (!text_symbol_indices || !functions) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t text_symbols_size = 0;
+    size_t functions_size = 0;
+
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        if (ctx->symbol_sections[i] != SECTION_TEXT) {
+            continue;
+        }
+
+        u32 offset = ctx->symbol_section_offsets[i];
+
+        if (functions_size == 0 || functions[functions_size - 1].offset != offset) {
+            functions[functions_size++] = (struct text_function){
+                .offset = offset,
+                .alignment = ctx->function_alignment,
+                .padding = ctx->symbol_paddings[i],
+                .first_symbol_index = text_symbols_size,
+            };
+        }
+
+        struct text_function *function = &functions[functions_size - 1];
+        if (ctx->profile_path) {
+            function->sample_count += ctx->symbol_sample_counts[i];
+        }
+        if (ctx->symbol_alignments[i] > function->alignment) {
+            function->alignment = ctx->symbol_alignments[i];
+        }
+        function->symbols_size++;
+
+        text_symbol_indices[text_symbols_size++] = i;
+    }
+
+    for (size_t i = 0; i < functions_size; i++) {
+        u32 end = i + 1 < functions_size ? functions[i + 1].offset - functions[i + 1].padding : ctx->text_size;
+        functions[i].size = end - functions[i].offset;
+    }
+
+    // The bytes before the first label don't belong to any function, so they stay in front
+    u32 prefix_size = functions_size > 0 ? functions[0].offset - functions[0].padding : ctx->text_size;
+
+    // Without a profile every function has 0 samples, so the order stays the same
+    qsort(functions, functions_size, sizeof(*functions), compare_text_functions);
+
+    size_t new_text_size = prefix_size;
+    for (size_t i = 0; i < functions_size; i++) {
+        functions[i].new_offset = align_up(new_text_size, functions[i].alignment);
+        new_text_size = functions[i].new_offset + functions[i].size;
+    }
+
+    u8 *text_bytes = malloc(new_text_size > 0 ? new_text_size : 1);
+    if (!text_bytes) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(text_bytes, ctx->text_bytes, prefix_size);
+
+    size_t end = prefix_size;
+    for (size_t i = 0; i < functions_size; i++) {
+        struct text_function *function = &functions[i];
+
+        store_nops(text_bytes + end, function->new_offset - end);
+        memcpy(text_bytes + function->new_offset, ctx->text_bytes + function->offset, function->size);
+        end = function->new_offset + function->size;
+
+        for (size_t j = 0; j < function->symbols_size; j++) {
+            ctx->symbol_section_offsets[text_symbol_indices[function->first_symbol_index + j]] = function->new_offset;
+        }
+    }
+
+    free(ctx->text_bytes);
+    ctx->text_bytes = text_bytes;
+    ctx->text_size = new_text_size;
+    ctx->text_capacity = new_text_size > 0 ? new_text_size : 1;
+
+    if (ctx->function_alignment > ctx->text_alignment) {
+        ctx->text_alignment = ctx->function_alignment;
+    }
+
+    free(functions);
+    free(text_symbol_indices);
+}
+
+static void parse_source(void) {
+    ctx->cursor = ctx->source;
+    ctx->source_end = ctx->source + ctx->source_size;
+    ctx->line_number = 1;
+    ctx->current_section = SECTION_TEXT;
+
+    while (ctx->cursor < ctx->source_end) {
+        parse_line();
+
+        skip_spaces();
+        if (!is_at_line_end()) {
+            parse_error("Unexpected character '%c'", *ctx->cursor);
+        }
+
+        // Skips the comment
+        while (ctx->cursor < ctx->source_end && *ctx->cursor != '\n') {
+            ctx->cursor++;
+        }
+
+        if (ctx->cursor < ctx->source_end) {
+            ctx->cursor++;
+            ctx->line_number++;
+        }
+    }
+
+    for (size_t i = 0; i < ctx->globals_size; i++) {
+        if (!ctx->is_global_defined[i]) {
+            fprintf(stderr, "error: %s: '%.*s' is declared global, but is never defined\n", ctx->source_path, (int)ctx->global_name_lengths[i], ctx->global_names[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < ctx->relocations_size; i++) {
+        u32 slot = *get_global_slot(ctx->relocation_names[i], ctx->relocation_name_lengths[i]);
+        if (slot == 0) {
+            fprintf(stderr, "error: %s: The address of '%.*s' is taken, but it isn't declared global\n", ctx->source_path, (int)ctx->relocation_name_lengths[i], ctx->relocation_names[i]);
+            exit(EXIT_FAILURE);
+        }
+
+        ctx->relocation_symbol_indices[i] = ctx->global_symbol_indices[slot - 1];
+    }
+
+    // The profile names the labels, which can only be looked up while the globals are still in the table
+    if (ctx->profile_path) {
+        read_profile();
+    }
+    if (ctx->profile_path || ctx->function_alignment > 1) {
+        layout_text_functions();
+    }
+
+    // The names are about to be unmapped, so the table is emptied for the next source
+    // Emptying the slots in reverse insertion order keeps the probe sequences of the remaining globals intact
+    for (size_t i = ctx->globals_size; i > 0; i--) {
+        *get_global_slot(ctx->global_names[i - 1], ctx->global_name_lengths[i - 1]) = 0;
+    }
+    ctx->globals_size = 0;
+}
+
+static void reset(void) {
+    ctx->symbols_size = 0;
+    ctx->relocations_size = 0;
+    ctx->chains_size = 0;
+    ctx->shuffled_symbols_size = 0;
+    ctx->bytes_size = 0;
+    ctx->phases_size = 0;
+    ctx->data_size = 0;
+    ctx->rodata_size = 0;
+    ctx->bss_size = 0;
+    ctx->text_size = 0;
+    ctx->has_data_labels = false;
+    ctx->has_rodata_labels = false;
+    ctx->has_bss_labels = false;
+    ctx->last_text_alignment = 1;
+    ctx->last_text_alignment_start = 0;
+    ctx->last_text_alignment_offset = 0;
+    ctx->text_alignment = 16; // NASM its default for .text
+}
+
+// Writing into the output in place would also change the --cache-dir entry it may be a hard link of,
+// so it gets replaced by a new file instead
+static void unlink_shared_output(void) {
+    struct stat st;
+    if (stat(ctx->output_path, &st) == 0 && st.st_nlink > 1 && unlink(ctx->output_path) == -1) {
+        perror("unlink");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void open_output(void) {
+    if (ctx->output_backend == OUTPUT_BACKEND_BUFFER) {
+        return;
+    }
+
+    if (ctx->output_backend == OUTPUT_BACKEND_MEMFD) {
+        ctx->output_fd = memfd_create(ctx->output_path, MFD_CLOEXEC);
+        if (ctx->output_fd == -1) {
+            perror("memfd_create");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        unlink_shared_output();
+
+        ctx->output_fd = open(ctx->output_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (ctx->output_fd == -1) {
+            perror("open");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The heap buffer of a previous run can't be mremap()ed
+    free(ctx->bytes);
+    ctx->bytes = NULL;
+    ctx->bytes_capacity = 0;
+}
+
+// Unmaps the image, and returns the file descriptor it was built in
+static int unmap_output(void) {
+    if (munmap(ctx->bytes, ctx->bytes_capacity) == -1) {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->bytes = NULL;
+    ctx->bytes_capacity = 0;
+
+    // Cuts off the capacity that wasn't used
+    if (ftruncate(ctx->output_fd, ctx->bytes_size) == -1) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = ctx->output_fd;
+    ctx->output_fd = -1;
+    return fd;
+}
+
+// Returns true when the output already holds exactly these bytes
+static bool is_output_unchanged(u8 *bytes, size_t bytes_size) {
+    int fd = open(ctx->output_path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+
+    bool is_unchanged = false;
+
+    // Reading the old bytes costs about as much as hashing them would, and can't collide
+    if ((size_t)st.st_size == bytes_size && st.st_size > 0) {
+        u8 *old_bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (old_bytes == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+
+        is_unchanged = memcmp(old_bytes, bytes, bytes_size) == 0;
+
+        munmap(old_bytes, st.st_size);
+    }
+
+    close(fd);
+    return is_unchanged;
+}
+
+static void write_output(void) {
+    if (ctx->output_backend == OUTPUT_BACKEND_MMAP) {
+        close(unmap_output());
+        return;
+    }
+
+    // Leaves the mtime and the page cache of the output alone, so whatever watches it doesn't reload it
+    if (ctx->skip_unchanged && is_output_unchanged(ctx->bytes, ctx->bytes_size)) {
+        return;
+    }
+
+    unlink_shared_output();
+
+    FILE *f = fopen(ctx->output_path, "w");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    fwrite(ctx->bytes, sizeof(u8), ctx->bytes_size, f);
+    fclose(f);
+}
+
+static void init_unloaded_sections(void) {
+    init_section_header_indices();
+    init_section_names();
+    init_unloaded_layout(ctx->is_debug_image ? ELF_HEADER_SIZE + ctx->program_header_count * PROGRAM_HEADER_SIZE : ctx->data_offset + ctx->data_reserved_size);
+}
+
+// Writes the .symtab and .strtab that --split-debug left out of the output to <output>.debug,
+// and stores its CRC-32 in the .gnu_debuglink of the output
+static void write_debug_file(void) {
+    // The debug file is pushed into a heap buffer of its own, even when the output is mapped
+    u8 *bytes = ctx->bytes;
+    size_t bytes_size = ctx->bytes_size;
+    size_t bytes_capacity = ctx->bytes_capacity;
+    int output_fd = ctx->output_fd;
+    ctx->bytes = NULL;
+    ctx->bytes_size = 0;
+    ctx->bytes_capacity = 0;
+    ctx->output_fd = -1;
+
+    // The loaded sections keep their section header indices, since .symtab and .strtab come after them
+    ctx->is_debug_image = true;
+    init_unloaded_sections();
+
+    reserve_bytes(ctx->section_headers_offset + ctx->section_count * SECTION_HEADER_SIZE);
+    push_debug_bytes();
+
+    char debug_path[4096];
+    get_debug_path(debug_path, sizeof(debug_path));
+
+    FILE *f = fopen(debug_path, "w");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    fwrite(ctx->bytes, sizeof(u8), ctx->bytes_size, f);
+    fclose(f);
+
+    u32 crc = get_crc32(ctx->bytes, ctx->bytes_size);
+
+    free(ctx->bytes);
+    ctx->bytes = bytes;
+    ctx->bytes_size = bytes_size;
+    ctx->bytes_capacity = bytes_capacity;
+    ctx->output_fd = output_fd;
+
+    ctx->is_debug_image = false;
+    init_unloaded_sections();
+
+    store_u32(ctx->bytes + ctx->gnu_debuglink_offset + ctx->gnu_debuglink_size - 4, crc);
+}
+
+// Assembles source_path into a finished image in bytes
+static void build_image(void) {
+    reset();
+
+    ctx->source_path_length = strlen(ctx->source_path);
+
+    begin_phase();
+    map_source();
+    parse_source();
+    end_phase("parse_source");
+
+    begin_phase();
+    hash_symbols();
+    end_phase("hash_symbols");
+
+    begin_phase();
+    init_is_substrs();
+    end_phase("init_is_substrs");
+
+    begin_phase();
+    init_symbol_name_dynstr_offsets();
+    end_phase("init_symbol_name_dynstr_offsets");
+
+    begin_phase();
+    generate_shuffled_symbols();
+    end_phase("generate_shuffled_symbols");
+
+    begin_phase();
+    init_symbol_name_strtab_offsets();
+    end_phase("init_symbol_name_strtab_offsets");
+
+    begin_phase();
+    init_hash_nbuckets();
+    end_phase("init_hash_nbuckets");
+
+    begin_phase();
+    init_dynsym_order();
+    end_phase("init_dynsym_order");
+
+    begin_phase();
+    init_relocations();
+    end_phase("init_relocations");
+
+    begin_phase();
+    init_section_header_indices();
+    init_section_names();
+    init_layout();
+    end_phase("init_layout");
+
+    begin_phase();
+    init_symbol_values();
+    end_phase("init_symbol_values");
+
+    begin_phase();
+    init_relocation_addends();
+    end_phase("init_relocation_addends");
+
+    open_output();
+
+    // The layout is known, so the buffer never has to grow
+    reserve_bytes(ctx->section_headers_offset + ctx->section_count * SECTION_HEADER_SIZE);
+
+    push_bytes();
+
+    // The debug file needs the symbol names, which point into the source
+    if (ctx->split_debug) {
+        begin_phase();
+        write_debug_file();
+        end_phase("write_debug_file");
+    }
+
+    unmap_source();
+}
+
+static void get_saved_layout_path(char *path, size_t path_size) {
+    if ((size_t)snprintf(path, path_size, "%s.layout", ctx->output_path) >= path_size) {
+        fprintf(stderr, "error: The output path '%s' is too long\n", ctx->output_path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static bool is_same_file_version(struct saved_layout *layout, struct stat *st) {
+    return layout->output_inode == st->st_ino
+        && layout->output_size == (u64)st->st_size
+        && layout->output_mtime.tv_sec == st->st_mtim.tv_sec
+        && layout->output_mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Returns false when there is no layout, or when it was saved with different options
+static bool read_saved_layout(struct saved_layout *layout) {
+    char path[4096];
+    get_saved_layout_path(path, sizeof(path));
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    bool was_read = fread(layout, sizeof(*layout), 1, f) == 1;
+    fclose(f);
+
+    return was_read
+        && layout->magic == SAVED_LAYOUT_MAGIC
+        && layout->hash_style == ctx->hash_style
+        && layout->is_symbolic == ctx->is_symbolic
+        && layout->pack_relative_relocs == ctx->pack_relative_relocs
+        && layout->separate_code == ctx->separate_code
+        && layout->relro == ctx->relro
+        && layout->pad_text_segment == ctx->pad_text_segment
+        && layout->max_page_size == ctx->max_page_size;
+}
+
+// Stamps the layout with the current version of the output, and saves it next to it
+static void write_saved_layout(struct saved_layout *layout) {
+    struct stat st;
+    if (stat(ctx->output_path, &st) == -1) {
+        perror("stat");
+        exit(EXIT_FAILURE);
+    }
+    layout->output_inode = st.st_ino;
+    layout->output_size = st.st_size;
+    layout->output_mtime = st.st_mtim;
+
+    char path[4096];
+    get_saved_layout_path(path, sizeof(path));
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    fwrite(layout, sizeof(*layout), 1, f);
+    fclose(f);
+}
+
+static void save_layout(void) {
+    // Zeroing the padding between the fields keeps the file the same for the same output
+    struct saved_layout layout;
+    memset(&layout, 0, sizeof(layout));
+
+    layout.magic = SAVED_LAYOUT_MAGIC;
+
+    layout.hash_style = ctx->hash_style;
+    layout.is_symbolic = ctx->is_symbolic;
+    layout.pack_relative_relocs = ctx->pack_relative_relocs;
+    layout.separate_code = ctx->separate_code;
+    layout.relro = ctx->relro;
+    layout.pad_text_segment = ctx->pad_text_segment;
+    layout.max_page_size = ctx->max_page_size;
+
+    layout.symbols_size = ctx->symbols_size;
+    layout.reserved_symbols_size = ctx->reserved_symbols_size;
+    layout.hash_nbucket = ctx->hash_nbucket;
+    layout.has_relocations = ctx->relocations_size > 0;
+
+    layout.hash_offset = ctx->hash_offset;
+    layout.dynsym_offset = ctx->dynsym_offset;
+    layout.dynstr_offset = ctx->dynstr_offset;
+    layout.dynstr_size = ctx->dynstr_size;
+    layout.dynstr_reserved_size = ctx->dynstr_reserved_size;
+    layout.rela_dyn_offset = ctx->rela_dyn_offset;
+    layout.rela_dyn_size = ctx->rela_dyn_size;
+    layout.relr_dyn_offset = ctx->relr_dyn_offset;
+    layout.relr_dyn_size = ctx->relr_dyn_size;
+    layout.has_text = has_text();
+    layout.text_offset = ctx->text_offset;
+    layout.text_size = ctx->text_size;
+    layout.text_reserved_size = ctx->text_reserved_size;
+    layout.has_rodata = has_rodata();
+    layout.rodata_offset = ctx->rodata_offset;
+    layout.rodata_size = ctx->rodata_size;
+    layout.rodata_reserved_size = ctx->rodata_reserved_size;
+    layout.eh_frame_offset = ctx->eh_frame_offset;
+    layout.dynamic_offset = ctx->dynamic_offset;
+    layout.dynamic_size = ctx->dynamic_size;
+    layout.has_data = has_data();
+    layout.data_offset = ctx->data_offset;
+    layout.data_address = ctx->data_address;
+    layout.data_size = ctx->data_size;
+    layout.data_reserved_size = ctx->data_reserved_size;
+    layout.has_bss = has_bss();
+    layout.bss_address = ctx->bss_address;
+    layout.symtab_offset = ctx->symtab_offset;
+    layout.strtab_offset = ctx->strtab_offset;
+    layout.strtab_size = ctx->strtab_size;
+    layout.strtab_reserved_size = ctx->strtab_reserved_size;
+    layout.section_headers_offset = ctx->section_headers_offset;
+
+    layout.hash_section_index = ctx->hash_section_index;
+    layout.dynsym_section_index = ctx->dynsym_section_index;
+    layout.dynstr_section_index = ctx->dynstr_section_index;
+    layout.text_section_index = ctx->text_section_index;
+    layout.rodata_section_index = ctx->rodata_section_index;
+    layout.data_section_index = ctx->data_section_index;
+    layout.bss_section_index = ctx->bss_section_index;
+    layout.symtab_section_index = ctx->symtab_section_index;
+    layout.strtab_section_index = ctx->strtab_section_index;
+
+    write_saved_layout(&layout);
+}
+
+// Looks every symbol up in the .hash of the previous output, the same way the dynamic linker does,
+// so that they keep their .dynsym index, and gives the new symbols the .dynsym entries after the old ones
+// Returns false when a symbol of the previous output is gone, since its .dynsym entry can't be removed
+static bool match_symbols(u8 *image, struct saved_layout *layout) {
+    u8 *buckets = image + layout->hash_offset + 8;
+    u8 *chains = buckets + layout->hash_nbucket * 4;
+    u8 *dynsym = image + layout->dynsym_offset;
+    char *dynstr = (char *)image + layout->dynstr_offset;
+
+    size_t matched_symbols_size = 0;
+    size_t next_dynsym_index = layout->symbols_size;
+
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        char *name = ctx->symbols[i];
+        size_t name_length = ctx->symbol_name_lengths[i];
+
+        u32 dynsym_index = load_u32(buckets + ctx->symbol_elf_hashes[i] % layout->hash_nbucket * 4);
+        while (dynsym_index != 0) {
+            char *old_name = dynstr + load_u32(dynsym + dynsym_index * SYMTAB_ENTRY_SIZE);
+            if (memcmp(old_name, name, name_length) == 0 && old_name[name_length] == '\0') {
+                break;
+            }
+            dynsym_index = load_u32(chains + dynsym_index * 4);
+        }
+
+        if (dynsym_index != 0) {
+            // `- 1`, because index 0 is always STN_UNDEF
+            ctx->symbol_index_to_dynsym_index[i] = dynsym_index - 1;
+            matched_symbols_size++;
+        } else {
+            ctx->symbol_index_to_dynsym_index[i] = next_dynsym_index++;
+        }
+    }
+
+    return matched_symbols_size == layout->symbols_size;
+}
+
+// Returns false when the relocations differ from the ones in the previous output
+static bool is_same_relocations(u8 *image, struct saved_layout *layout) {
+    if ((ctx->relocations_size > 0) != layout->has_relocations) {
+        return false;
+    }
+
+    init_relocations();
+    init_relocation_addends();
+
+    if (ctx->rela_dyn_size != layout->rela_dyn_size || ctx->relr_dyn_size != layout->relr_dyn_size) {
+        return false;
+    }
+
+    // Pushed into the otherwise unused image buffer, to compare them with what is in the output
+    ctx->bytes_size = 0;
+    reserve_bytes(ctx->rela_dyn_size + ctx->relr_dyn_size);
+    push_rela_dyn();
+    push_relr_dyn();
+
+    return memcmp(ctx->bytes, image + layout->rela_dyn_offset, ctx->rela_dyn_size) == 0
+        && memcmp(ctx->bytes + ctx->rela_dyn_size, image + layout->relr_dyn_offset, ctx->relr_dyn_size) == 0;
+}
+
+// Only writes when the bytes changed, so that the pages of the output that stay the same don't get dirtied
+static void patch_span(u8 *dest, const void *span, size_t count) {
+    if (memcmp(dest, span, count) != 0) {
+        memcpy(dest, span, count);
+    }
+}
+
+static void patch_symbol_entry(u8 *entry, u32 name, u16 shndx, u32 value) {
+    u8 new_entry[SYMTAB_ENTRY_SIZE] = {0};
+    store_u32(new_entry, name);
+    store_u16(new_entry + 4, ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE));
+    store_u16(new_entry + 6, shndx);
+    store_u32(new_entry + 8, value);
+
+    patch_span(entry, new_entry, SYMTAB_ENTRY_SIZE);
+}
+
+// Overwrites the section, and zeros what is left of the bytes it used to have
+static void patch_section(u8 *section, u8 *bytes, size_t size, size_t old_size) {
+    patch_span(section, bytes, size);
+    if (size < old_size) {
+        memset(section + size, 0, old_size - size);
+    }
+}
+
+static void patch_section_size(u8 *image, struct saved_layout *layout, u16 section_index, u64 size) {
+    store_u64(image + layout->section_headers_offset + section_index * SECTION_HEADER_SIZE + 32, size); // sh_size
+}
+
+static void patch_segment_size(u8 *image, size_t program_header_index, u64 file_size, u64 mem_size) {
+    u8 *program_header = image + ELF_HEADER_SIZE + program_header_index * PROGRAM_HEADER_SIZE;
+    store_u64(program_header + 32, file_size); // p_filesz
+    store_u64(program_header + 40, mem_size); // p_memsz
+}
+
+static void patch_dynamic_entry(u8 *image, struct saved_layout *layout, u64 tag, u64 value) {
+    for (u8 *entry = image + layout->dynamic_offset; load_u64(entry) != DT_NULL; entry += DYNAMIC_ENTRY_SIZE) {
+        if (load_u64(entry) == tag) {
+            store_u64(entry + 8, value);
+        }
+    }
+}
+
+// Returns false when the changes don't fit in the slack of the previous output, without having changed it
+static bool patch_image(u8 *image, struct saved_layout *layout) {
+    if (strcmp((char *)image + layout->strtab_offset + 1, ctx->source_path) != 0) {
+        return false; // .strtab starts with the source path, which would have to move everything after it
+    }
+
+    // Adding or removing .text, .rodata, .data or .bss would renumber the sections after it
+    if (has_text() != layout->has_text || has_rodata() != layout->has_rodata || has_data() != layout->has_data || has_bss() != layout->has_bss) {
+        return false;
+    }
+
+    if (ctx->symbols_size > layout->reserved_symbols_size
+     || ctx->text_size > layout->text_reserved_size
+     || ctx->rodata_size > layout->rodata_reserved_size
+     || ctx->data_size > layout->data_reserved_size) {
+        return false;
+    }
+
+    // .bss grows in place, so a full rebuild has to report it when it grew past what symbol values can hold, see init_layout()
+    if (layout->has_bss && layout->bss_address + get_bss_section_size(layout->bss_address) > UINT32_MAX) {
+        return false;
+    }
+
+    begin_phase();
+    bool is_matched = match_symbols(image, layout);
+    end_phase("match_symbols");
+    if (!is_matched) {
+        return false;
+    }
+
+    size_t new_names_size = 0;
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        if (ctx->symbol_index_to_dynsym_index[i] >= layout->symbols_size) {
+            new_names_size += ctx->symbol_name_lengths[i] + 1;
+        }
+    }
+    if (layout->dynstr_size + new_names_size > layout->dynstr_reserved_size
+     || layout->strtab_size + new_names_size > layout->strtab_reserved_size) {
+        return false;
+    }
+
+    ctx->text_offset = layout->text_offset;
+    ctx->rodata_offset = layout->rodata_offset;
+    ctx->eh_frame_offset = layout->eh_frame_offset; // See get_text_symbol_section_index()
+    ctx->data_address = layout->data_address;
+    ctx->bss_address = layout->bss_address;
+    ctx->text_section_index = layout->text_section_index;
+    ctx->rodata_section_index = layout->rodata_section_index;
+    ctx->data_section_index = layout->data_section_index;
+    ctx->bss_section_index = layout->bss_section_index;
+    init_symbol_values();
+
+    if (!is_same_relocations(image, layout)) {
+        return false;
+    }
+
+    begin_phase();
+
+    u8 *buckets = image + layout->hash_offset + 8;
+    u8 *chains = buckets + layout->hash_nbucket * 4;
+    u8 *dynsym = image + layout->dynsym_offset;
+    u8 *dynstr = image + layout->dynstr_offset;
+    u8 *symtab = image + layout->symtab_offset;
+    u8 *strtab = image + layout->strtab_offset;
+
+    for (size_t i = 0; i < ctx->symbols_size; i++) {
+        size_t dynsym_index = 1 + ctx->symbol_index_to_dynsym_index[i]; // `1 + `, because index 0 is always STN_UNDEF
+        size_t symtab_index = SYMTAB_LOCAL_ENTRY_COUNT + ctx->symbol_index_to_dynsym_index[i]; // .symtab has the same order as .dynsym
+        u8 *dynsym_entry = dynsym + dynsym_index * SYMTAB_ENTRY_SIZE;
+        u8 *symtab_entry = symtab + symtab_index * SYMTAB_ENTRY_SIZE;
+
+        u32 dynstr_offset;
+        u32 strtab_offset;
+        if (ctx->symbol_index_to_dynsym_index[i] < layout->symbols_size) {
+            dynstr_offset = load_u32(dynsym_entry);
+            strtab_offset = load_u32(symtab_entry);
+        } else {
+            // New names are appended, without tail merging them
+            dynstr_offset = layout->dynstr_size;
+            memcpy(dynstr + layout->dynstr_size, ctx->symbols[i], ctx->symbol_name_lengths[i]);
+            layout->dynstr_size += ctx->symbol_name_lengths[i] + 1;
+
+            strtab_offset = layout->strtab_size;
+            memcpy(strtab + layout->strtab_size, ctx->symbols[i], ctx->symbol_name_lengths[i]);
+            layout->strtab_size += ctx->symbol_name_lengths[i] + 1;
+
+            u32 bucket_index = ctx->symbol_elf_hashes[i] % layout->hash_nbucket;
+            store_u32(chains + dynsym_index * 4, load_u32(buckets + bucket_index * 4));
+            store_u32(buckets + bucket_index * 4, dynsym_index);
+        }
+
+        patch_symbol_entry(dynsym_entry, dynstr_offset, ctx->symbol_section_indices[i], ctx->symbol_values[i]);
+        patch_symbol_entry(symtab_entry, strtab_offset, ctx->symbol_section_indices[i], ctx->symbol_values[i]);
+    }
+
+    patch_section(image + layout->text_offset, ctx->text_bytes, ctx->text_size, layout->text_size);
+    if (layout->has_rodata) {
+        patch_section(image + layout->rodata_offset, ctx->rodata_bytes, ctx->rodata_size, layout->rodata_size);
+    }
+    if (layout->has_data) {
+        patch_section(image + layout->data_offset, ctx->data_bytes, ctx->data_size, layout->data_size);
+    }
+
+    store_u32(image + layout->hash_offset + 4, 1 + ctx->symbols_size); // nchain
+
+    patch_section_size(image, layout, layout->hash_section_index, (2 + layout->hash_nbucket + 1 + ctx->symbols_size) * 4);
+    patch_section_size(image, layout, layout->dynsym_section_index, (1 + ctx->symbols_size) * SYMTAB_ENTRY_SIZE);
+    patch_section_size(image, layout, layout->dynstr_section_index, layout->dynstr_size);
+    if (layout->has_text) {
+        patch_section_size(image, layout, layout->text_section_index, ctx->text_size);
+    }
+    if (layout->has_rodata) {
+        patch_section_size(image, layout, layout->rodata_section_index, ctx->rodata_size);
+    }
+    if (layout->has_data) {
+        patch_section_size(image, layout, layout->data_section_index, ctx->data_size);
+    }
+    if (layout->has_bss) {
+        patch_section_size(image, layout, layout->bss_section_index, get_bss_section_size(layout->bss_address));
+    }
+    patch_section_size(image, layout, layout->symtab_section_index, (SYMTAB_LOCAL_ENTRY_COUNT + ctx->symbols_size) * SYMTAB_ENTRY_SIZE);
+    patch_section_size(image, layout, layout->strtab_section_index, layout->strtab_size);
+
+    // See push_program_headers(), which had the same segments, since which sections there are didn't change
+    if (has_text_segment() && !layout->pad_text_segment) {
+        patch_segment_size(image, 1, ctx->text_size, ctx->text_size);
+    }
+
+    // .bss comes after the slack of .data, so it can grow without moving anything
+    size_t data_segment_file_size = layout->dynamic_size + ctx->data_size;
+    size_t dynamic_address = layout->data_address - layout->dynamic_size;
+    size_t data_segment_mem_size = layout->has_bss ? layout->bss_address + get_bss_section_size(layout->bss_address) - dynamic_address : data_segment_file_size;
+    patch_segment_size(image, get_data_segment_index(), data_segment_file_size, data_segment_mem_size);
+
+    patch_dynamic_entry(image, layout, DT_STRSZ, layout->dynstr_size);
+
+    layout->symbols_size = ctx->symbols_size;
+    layout->text_size = ctx->text_size;
+    layout->rodata_size = ctx->rodata_size;
+    layout->data_size = ctx->data_size;
+
+    end_phase("patch_image");
+
+    return true;
+}
+
+// Patches the previous output in place with what changed in the source, using the slack that --incremental reserved
+// Returns false when it has to be rebuilt instead, because there is no usable layout, or the slack ran out
+static bool patch_output(void) {
+    begin_phase();
+    struct saved_layout layout;
+    bool has_layout = read_saved_layout(&layout);
+    end_phase("read_saved_layout");
+    if (!has_layout) {
+        return false;
+    }
+
+    int fd = open(ctx->output_path, O_RDWR);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    if (!is_same_file_version(&layout, &st) || st.st_nlink > 1) {
+        close(fd);
+        return false;
+    }
+
+    u8 *image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    reset();
+    ctx->source_path_length = strlen(ctx->source_path);
+
+    begin_phase();
+    map_source();
+    parse_source();
+    end_phase("parse_source");
+
+    begin_phase();
+    hash_symbols();
+    end_phase("hash_symbols");
+
+    // The relocations get compared in the image buffer, which the mmap backend can't provide before the output is opened
+    enum output_backend output_backend = ctx->output_backend;
+    ctx->output_backend = OUTPUT_BACKEND_BUFFER;
+    bool is_patched = patch_image(image, &layout);
+    ctx->output_backend = output_backend;
+
+    unmap_source();
+
+    if (munmap(image, st.st_size) == -1) {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+
+    if (is_patched) {
+        write_saved_layout(&layout);
+    }
+
+    return is_patched;
+}
+
+// A 64-bit multiply-xorshift hash, which reads 8 bytes at a time
+static u64 hash_bytes(u64 hash, const void *bytes, size_t size) {
+    const u8 *p = bytes;
+
+    for (; size >= 8; p += 8, size -= 8) {
+        hash = (hash ^ load_u64(p)) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 32;
+    }
+
+    u8 tail[8] = {0};
+    memcpy(tail, p, size);
+    hash = (hash ^ load_u64(tail) ^ size) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+// The key of the cache entry covers everything that ends up in the image:
+// the source, its path, which .strtab holds, and every option that changes the layout
+static u64 get_cache_key(void) {
+    u64 options[] = {
+        CACHE_KEY_VERSION,
+        ctx->hash_style,
+        ctx->optimize_hash_buckets,
+        ctx->is_symbolic,
+        ctx->pack_relative_relocs,
+        ctx->separate_code,
+        ctx->relro,
+        ctx->max_page_size,
+        ctx->pad_text_segment,
+        ctx->strip_all,
+        ctx->function_alignment,
+    };
+
+    u64 hash = hash_bytes(0, options, sizeof(options));
+    hash = hash_bytes(hash, ctx->source_path, strlen(ctx->source_path));
+
+    map_source();
+    hash = hash_bytes(hash, ctx->source, ctx->source_size);
+    unmap_source();
+
+    // The order of .text depends on the profile
+    if (ctx->profile_path) {
+        char *source_path = ctx->source_path;
+        ctx->source_path = ctx->profile_path;
+        map_source();
+        hash = hash_bytes(hash, ctx->source, ctx->source_size);
+        unmap_source();
+        ctx->source_path = source_path;
+    }
+
+    return hash;
+}
+
+static void get_cache_entry_path(char *path, size_t path_size, u64 key) {
+    if ((size_t)snprintf(path, path_size, "%s/%016llx.so", ctx->cache_dir, (unsigned long long)key) >= path_size) {
+        fprintf(stderr, "error: The cache directory path '%s' is too long\n", ctx->cache_dir);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Returns false when the file couldn't be copied
+static bool copy_file(char *from_path, char *to_path) {
+    int from_fd = open(from_path, O_RDONLY);
+    if (from_fd == -1) {
+        return false;
+    }
+    int to_fd = open(to_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (to_fd == -1) {
+        close(from_fd);
+        return false;
+    }
+
+    u8 buffer[0x10000];
+    ssize_t size;
+    bool is_copied = true;
+    while ((size = read(from_fd, buffer, sizeof(buffer))) > 0) {
+        if (write(to_fd, buffer, size) != size) {
+            is_copied = false;
+            break;
+        }
+    }
+    if (size == -1) {
+        is_copied = false;
+    }
+
+    close(from_fd);
+    close(to_fd);
+    return is_copied;
+}
+
+// Atomically replaces to_path with a hard link of from_path,
+// or with a copy of it when they are on different file systems
+// Returns false when neither worked
+static bool link_or_copy(char *from_path, char *to_path) {
+    // Every batch worker needs a temporary path of its own
+    char tmp_path[4096];
+    if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%lu.tmp", to_path, (int)getpid(), (unsigned long)pthread_self()) >= sizeof(tmp_path)) {
+        fprintf(stderr, "error: The path '%s' is too long\n", to_path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (link(from_path, tmp_path) == -1 && !copy_file(from_path, tmp_path)) {
+        unlink(tmp_path);
+        return false;
+    }
+
+    if (rename(tmp_path, to_path) == -1) {
+        unlink(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
+static bool is_same_file(char *path_a, char *path_b) {
+    struct stat st_a;
+    struct stat st_b;
+    return stat(path_a, &st_a) == 0
+        && stat(path_b, &st_b) == 0
+        && st_a.st_dev == st_b.st_dev
+        && st_a.st_ino == st_b.st_ino;
+}
+
+// Returns true when the output was taken from the cache, so it doesn't have to be generated
+static bool restore_cached_output(char *cache_entry_path) {
+    // The output is still the hard link that the last run left behind
+    if (is_same_file(cache_entry_path, ctx->output_path)) {
+        return true;
+    }
+
+    // Hard linking would change the mtime of the output even when its bytes are the same
+    int fd = open(cache_entry_path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+
+    u8 *cached_bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (cached_bytes == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    bool is_unchanged = is_output_unchanged(cached_bytes, st.st_size);
+    munmap(cached_bytes, st.st_size);
+
+    return is_unchanged || link_or_copy(cache_entry_path, ctx->output_path);
+}
+
+// Hard links the output into the cache, so the next run with the same input can take it from there
+static void store_cached_output(char *cache_entry_path) {
+    if (!link_or_copy(ctx->output_path, cache_entry_path)) {
+        fprintf(stderr, "warning: Couldn't store '%s' in the cache directory '%s'\n", ctx->output_path, ctx->cache_dir);
+    }
+}
+
+// JSON strings have to escape quotes, backslashes and control characters
+static void print_json_string(char *str) {
+    putchar('"');
+    for (unsigned char *c = (unsigned char *)str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if (*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+// The chain lengths are the indices of the array, so [3, 5, 1] means 3 empty buckets,
+// 5 buckets with one symbol, and 1 bucket with two symbols
+static void print_chain_lengths_json(char *name, u32 nbucket, u32 *chain_length_counts, size_t chain_length_counts_size) {
+    printf(", \"%s\": {\"nbucket\": %u, \"chain_length_counts\": [", name, nbucket);
+
+    for (size_t i = 0; i < chain_length_counts_size; i++) {
+        printf("%s%u", i > 0 ? ", " : "", chain_length_counts[i]);
+    }
+
+    printf("]}");
+}
+
+static void print_stats_json(void) {
+    printf("{\"source\": ");
+    print_json_string(ctx->source_path);
+    printf(", \"output\": ");
+    print_json_string(ctx->output_path);
+    printf(", \"bytes\": %zu, \"phases\": [", ctx->bytes_size);
+
+    for (size_t i = 0; i < ctx->phases_size; i++) {
+        printf("%s{\"name\": \"%s\", \"seconds\": %.9f, \"bytes\": %zu, \"peak_rss_kib\": %ld}", i > 0 ? ", " : "", ctx->phase_names[i], ctx->phase_seconds[i], ctx->phase_bytes[i], ctx->phase_peak_rss_kib[i]);
+    }
+
+    printf("]");
+
+    if (!ctx->has_chain_length_counts) {
+        printf("}\n");
+        return;
+    }
+
+    if (ctx->hash_style & HASH_STYLE_SYSV) {
+        print_chain_lengths_json("hash", ctx->hash_nbucket, ctx->hash_chain_length_counts, ctx->hash_chain_length_counts_size);
+    }
+    if (ctx->hash_style & HASH_STYLE_GNU) {
+        print_chain_lengths_json("gnu_hash", ctx->gnu_hash_nbucket, ctx->gnu_hash_chain_length_counts, ctx->gnu_hash_chain_length_counts_size);
+    }
+
+    printf("}\n");
+}
+
+static void print_chain_lengths_text(char *name, u32 nbucket, u32 *chain_length_counts, size_t chain_length_counts_size) {
+    printf("\n%s with %u buckets\n", name, nbucket);
+    printf("%-32s %12s\n", "chain length", "buckets");
+
+    for (size_t i = 0; i < chain_length_counts_size; i++) {
+        if (chain_length_counts[i] > 0) {
+            printf("%-32zu %12u\n", i, chain_length_counts[i]);
+        }
+    }
+}
+
+static void print_stats_text(void) {
+    printf("%s -> %s\n", ctx->source_path, ctx->output_path);
+    printf("%-32s %12s %12s %14s\n", "phase", "ms", "bytes", "peak RSS KiB");
+
+    double total_seconds = 0;
+    for (size_t i = 0; i < ctx->phases_size; i++) {
+        printf("%-32s %12.3f %12zu %14ld\n", ctx->phase_names[i], ctx->phase_seconds[i] * 1e3, ctx->phase_bytes[i], ctx->phase_peak_rss_kib[i]);
+        total_seconds += ctx->phase_seconds[i];
+    }
+
+    // The total bytes also include the padding between the sections
+    printf("%-32s %12.3f %12zu\n", "total", total_seconds * 1e3, ctx->bytes_size);
+
+    if (!ctx->has_chain_length_counts) {
+        return;
+    }
+
+    if (ctx->hash_style & HASH_STYLE_SYSV) {
+        print_chain_lengths_text(".hash", ctx->hash_nbucket, ctx->hash_chain_length_counts, ctx->hash_chain_length_counts_size);
+    }
+    if (ctx->hash_style & HASH_STYLE_GNU) {
+        print_chain_lengths_text(".gnu.hash", ctx->gnu_hash_nbucket, ctx->gnu_hash_chain_length_counts, ctx->gnu_hash_chain_length_counts_size);
+    }
+}
+
+// The batch workers share stdout, so their stats mustn't get interleaved
+static void print_stats(void) {
+    flockfile(stdout);
+
+    if (ctx->stats_format == STATS_FORMAT_JSON) {
+        print_stats_json();
+    } else if (ctx->stats_format == STATS_FORMAT_TEXT) {
+        print_stats_text();
+    }
+
+    funlockfile(stdout);
+}
+
+static void generate_simple_so(void) {
+    // Patching in place would change the cache entry that the output is a hard link of
+    if (ctx->incremental && ctx->cache_dir) {
+        fprintf(stderr, "error: --incremental can't be combined with --cache-dir\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A cached output would skip writing its debug file
+    if (ctx->split_debug && ctx->cache_dir) {
+        fprintf(stderr, "error: --split-debug can't be combined with --cache-dir\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The mmap backend truncates the output before building the image in it, so there is nothing left to compare the image with
+    if (ctx->skip_unchanged && ctx->output_backend == OUTPUT_BACKEND_MMAP) {
+        fprintf(stderr, "error: %s can't be combined with --output-backend=mmap\n", ctx->cache_dir ? "--cache-dir" : "--skip-unchanged");
+        exit(EXIT_FAILURE);
+    }
+
+    // A batch worker reuses its context, so the counts of its previous job mustn't get printed
+    ctx->has_chain_length_counts = false;
+
+    if (ctx->incremental && patch_output()) {
+        print_stats();
+        return;
+    }
+
+    char cache_entry_path[4096];
+    if (ctx->cache_dir) {
+        begin_phase();
+        get_cache_entry_path(cache_entry_path, sizeof(cache_entry_path), get_cache_key());
+        bool is_restored = restore_cached_output(cache_entry_path);
+        end_phase("restore_cached_output");
+
+        if (is_restored) {
+            print_stats();
+            return;
+        }
+    }
+
+    build_image();
+
+    begin_phase();
+    write_output();
+    end_phase("write_output");
+
+    if (ctx->incremental) {
+        save_layout();
+    }
+
+    if (ctx->cache_dir) {
+        begin_phase();
+        store_cached_output(cache_entry_path);
+        end_phase("store_cached_output");
+    }
+
+    print_stats();
+}
+
+// Copies every option that the command line can set from the context of main() or of a host process
+static void copy_options(struct context *options) {
+    ctx->hash_style = options->hash_style;
+    ctx->output_backend = options->output_backend;
+    ctx->stats_format = options->stats_format;
+    ctx->optimize_hash_buckets = options->optimize_hash_buckets;
+    ctx->hash_thread_count = options->hash_thread_count;
+    ctx->is_symbolic = options->is_symbolic;
+    ctx->pack_relative_relocs = options->pack_relative_relocs;
+    ctx->separate_code = options->separate_code;
+    ctx->relro = options->relro;
+    ctx->max_page_size = options->max_page_size;
+    ctx->pad_text_segment = options->pad_text_segment;
+    ctx->incremental = options->incremental;
+    ctx->skip_unchanged = options->skip_unchanged;
+    ctx->cache_dir = options->cache_dir;
+    ctx->strip_all = options->strip_all;
+    ctx->split_debug = options->split_debug;
+    ctx->profile_path = options->profile_path;
+    ctx->function_alignment = options->function_alignment;
+}
+
+// The generate_full_so_*() functions aren't static, since they are the entry points for host processes
+// Their options are the fields of a context from create_context() that the command line can set, see copy_options()
+
+// Generates source_path into output_path, in the same way as the command line does
+void generate_full_so_file(char *source_path, char *output_path, struct context *options) {
+    init_thread_context();
+    copy_options(options);
+    ctx->source_path = source_path;
+    ctx->output_path = output_path;
+    generate_simple_so();
+}
+
+// Returns the finished image of source_path, which stays valid until the next generation
+u8 *generate_full_so_image(char *source_path, struct context *options, size_t *size) {
+    init_thread_context();
+    copy_options(options);
+    ctx->source_path = source_path;
+    ctx->output_backend = OUTPUT_BACKEND_BUFFER;
+    build_image();
+
+    *size = ctx->bytes_size;
+    return ctx->bytes;
+}
+
+// Returns a memfd_create() file holding the finished image of source_path,
+// so it can be passed to dlopen() as "/proc/self/fd/<fd>" without touching the disk
+// The caller has to close() it once it has been dlopen()ed
+int generate_full_so_memfd(char *source_path, struct context *options) {
+    init_thread_context();
+    copy_options(options);
+    ctx->source_path = source_path;
+    ctx->output_backend = OUTPUT_BACKEND_MEMFD;
+    build_image();
+
+    return unmap_output();
+}
+
+static void push_job(char *source_path, char *output_path) {
+    if (jobs_size + 1 > MAX_JOBS) {
+        fprintf(stderr, "error: MAX_JOBS of %d was exceeded\n", MAX_JOBS);
+        exit(EXIT_FAILURE);
+    }
+
+    job_source_paths[jobs_size] = source_path;
+    job_output_paths[jobs_size] = output_path;
+    jobs_size++;
+}
+
+// Every non-empty line of the jobs file is "<input> <output>"
+static void read_jobs(void) {
+    FILE *f = fopen(batch_path, "r");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    size_t line_number = 0;
+
+    while (getline(&line, &line_capacity, f) != -1) {
+        line_number++;
+
+        char *source_path = strtok(line, " \t\r\n");
+        if (!source_path) {
+            continue;
+        }
+
+        char *output_path = strtok(NULL, " \t\r\n");
+        if (!output_path || strtok(NULL, " \t\r\n")) {
+            fprintf(stderr, "error: %s:%zu: Expected \"<input> <output>\"\n", batch_path, line_number);
+            exit(EXIT_FAILURE);
+        }
+
+        push_job(strdup(source_path), strdup(output_path));
+    }
+
+    free(line);
+    fclose(f);
+}
+
+// Every worker generates with its own context, and keeps taking the next job until there are none left
+static void *run_batch_worker(void *arg) {
+    struct context *options = arg;
+
+    ctx = create_context();
+    copy_options(options);
+    ctx->hash_thread_count = 1;
+
+    while (true) {
+        size_t job_index = atomic_fetch_add(&next_job_index, 1);
+        if (job_index >= jobs_size) {
+            break;
+        }
+
+        ctx->source_path = job_source_paths[job_index];
+        ctx->output_path = job_output_paths[job_index];
+
+        generate_simple_so();
+    }
+
+    destroy_context(ctx);
+    ctx = NULL;
+
+    return NULL;
+}
+
+// Spreads the jobs over the cores, where the first error stops the whole batch
+static void run_batch(void) {
+    read_jobs();
+
+    if (thread_count <= 0) {
+        thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if ((size_t)thread_count > jobs_size) {
+        thread_count = jobs_size;
+    }
+
+    pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+    if (!threads) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (long i = 0; i < thread_count; i++) {
+        int err = pthread_create(&threads[i], NULL, run_batch_worker, ctx);
+        if (err != 0) {
+            fprintf(stderr, "error: pthread_create: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (long i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+}
+
+// Returns the alignment of an option, which has to be a power of 2 up to a page
+static size_t parse_alignment(char *value, char *arg) {
+    char *end;
+    unsigned long long alignment = strtoull(value, &end, 0);
+    if (*end != '\0' || alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > PAGE_SIZE) {
+        fprintf(stderr, "error: The alignment of '%s' has to be a power of 2 up to %d\n", arg, PAGE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    return alignment;
+}
+
+// Returns false when ld doesn't know the keyword either, or when it isn't supported
+static bool parse_z_keyword(char *keyword) {
+    if (strcmp(keyword, "pack-relative-relocs") == 0) {
+        ctx->pack_relative_relocs = true;
+    } else if (strcmp(keyword, "separate-code") == 0) {
+        ctx->separate_code = true;
+    } else if (strcmp(keyword, "noseparate-code") == 0) {
+        ctx->separate_code = false;
+    } else if (strcmp(keyword, "relro") == 0) {
+        ctx->relro = true;
+    } else if (strcmp(keyword, "norelro") == 0) {
+        ctx->relro = false;
+    } else if (strncmp(keyword, "max-page-size=", 14) == 0) {
+        char *end;
+        unsigned long size = strtoul(keyword + 14, &end, 0);
+        if (*end != '\0' || size < PAGE_SIZE || (size & (size - 1)) != 0) {
+            fprintf(stderr, "error: The max page size has to be a power of 2 of at least 0x%x, but got '%s'\n", PAGE_SIZE, keyword + 14);
+            exit(EXIT_FAILURE);
+        }
+        ctx->max_page_size = size;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+
+        if (strcmp(arg, "--hash-style=sysv") == 0) {
+            ctx->hash_style = HASH_STYLE_SYSV;
+        } else if (strcmp(arg, "--hash-style=gnu") == 0) {
+            ctx->hash_style = HASH_STYLE_GNU;
+        } else if (strcmp(arg, "--hash-style=both") == 0) {
+            ctx->hash_style = HASH_STYLE_BOTH;
+        } else if (strcmp(arg, "--output-backend=buffer") == 0) {
+            ctx->output_backend = OUTPUT_BACKEND_BUFFER;
+        } else if (strcmp(arg, "--output-backend=mmap") == 0) {
+            ctx->output_backend = OUTPUT_BACKEND_MMAP;
+        } else if (strncmp(arg, "-o", 2) == 0 && arg[2] != '\0') {
+            ctx->output_path = arg + 2;
+        } else if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+            ctx->output_path = argv[++i];
+        } else if (strcmp(arg, "-Bsymbolic") == 0) {
+            ctx->is_symbolic = true;
+        } else if (strcmp(arg, "-z") == 0 && i + 1 < argc && parse_z_keyword(argv[i + 1])) {
+            i++;
+        } else if (strncmp(arg, "-z", 2) == 0 && parse_z_keyword(arg + 2)) {
+            // ld also accepts the keyword glued to -z
+        } else if (strcmp(arg, "--huge-page-text") == 0) {
+            ctx->max_page_size = HUGE_PAGE_SIZE;
+            ctx->pad_text_segment = true;
+        } else if (strcmp(arg, "--incremental") == 0) {
+            ctx->incremental = true;
+        } else if (strcmp(arg, "--skip-unchanged") == 0) {
+            ctx->skip_unchanged = true;
+        } else if (strncmp(arg, "--cache-dir=", 12) == 0) {
+            ctx->cache_dir = arg + 12;
+            ctx->skip_unchanged = true;
+        } else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--strip-all") == 0) {
+            ctx->strip_all = true;
+        } else if (strcmp(arg, "--split-debug") == 0) {
+            ctx->strip_all = true;
+            ctx->split_debug = true;
+        } else if (strncmp(arg, "--profile=", 10) == 0) {
+            ctx->profile_path = arg + 10;
+        } else if (strncmp(arg, "--align-functions=", 18) == 0) {
+            ctx->function_alignment = parse_alignment(arg + 18, arg);
+        } else if (strcmp(arg, "--compact") == 0) {
+            ctx->separate_code = false;
+            ctx->relro = false;
+        } else if (strcmp(arg, "-O0") == 0) {
+            ctx->optimize_hash_buckets = false;
+        } else if (strcmp(arg, "-O1") == 0) {
+            ctx->optimize_hash_buckets = true;
+        } else if (strcmp(arg, "--stats") == 0) {
+            ctx->stats_format = STATS_FORMAT_TEXT;
+        } else if (strcmp(arg, "--stats=json") == 0) {
+            ctx->stats_format = STATS_FORMAT_JSON;
+        } else if (strncmp(arg, "--batch=", 8) == 0) {
+            batch_path = arg + 8;
+        } else if (strncmp(arg, "--jobs=", 7) == 0) {
+            thread_count = atol(arg + 7);
+        } else if (arg[0] != '-') {
+            ctx->source_path = arg;
+        } else {
+            fprintf(stderr, "error: Unknown argument '%s'\n", arg);
+            fprintf(stderr, "usage: %s [--hash-style=sysv|gnu|both] [--output-backend=buffer|mmap] [-O0|-O1] [-Bsymbolic] [-z pack-relative-relocs] [-z [no]separate-code] [-z [no]relro] [-z max-page-size=size] [--compact] [--huge-page-text] [--incremental] [--skip-unchanged] [--cache-dir=dir] [-s|--strip-all] [--split-debug] [--profile=profile] [--align-functions=alignment] [--stats[=json]] [-o output] [input]\n", argv[0]);
+            fprintf(stderr, "       %s [--hash-style=sysv|gnu|both] [--output-backend=buffer|mmap] [-O0|-O1] [-Bsymbolic] [-z pack-relative-relocs] [-z [no]separate-code] [-z [no]relro] [-z max-page-size=size] [--compact] [--huge-page-text] [--incremental] [--skip-unchanged] [--cache-dir=dir] [-s|--strip-all] [--split-debug] [--profile=profile] [--align-functions=alignment] [--stats[=json]] --batch=jobs [--jobs=threads]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Benchmarks #include this file with this defined, so they can call the static functions
+#ifndef GENERATE_FULL_SO_NO_MAIN
+int main(int argc, char *argv[]) {
+    ctx = create_context();
+
+    parse_args(argc, argv);
+
+    if (batch_path) {
+        run_batch();
+    } else {
+        generate_simple_so();
+    }
 }
+#endif
@@ -42,43 +42,85 @@ typedef uint64_t u64;
 // https://docs.oracle.com/cd/E19683-01/816-1386/chapter6-79797/index.html
 #define ELF32_ST_INFO(bind, type) (((bind)<<4)+((type)&0xf))
 
-#define MAX_BYTES_SIZE 420420
-u8 bytes[MAX_BYTES_SIZE];
+#define MIN_BYTES_CAPACITY 0x1000
+u8 *bytes;
 size_t bytes_size = 0;
+size_t bytes_capacity = 0;
 
-static void push(u8 byte) {
-    if (bytes_size + 1 > MAX_BYTES_SIZE) {
-        fprintf(stderr, "MAX_BYTES_SIZE of %d was exceeded\n", MAX_BYTES_SIZE);
+// Makes sure at least `capacity` bytes fit, doubling the capacity so that pushing stays amortized O(1)
+static void reserve_bytes(size_t capacity) {
+    if (capacity <= bytes_capacity) {
+        return;
+    }
+
+    size_t new_capacity = bytes_capacity > 0 ? bytes_capacity : MIN_BYTES_CAPACITY;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+
+    u8 *new_bytes = realloc(bytes, new_capacity);
+    if (!new_bytes) {
+        perror("realloc");
         exit(EXIT_FAILURE);
     }
 
-    bytes[bytes_size++] = byte;
+    bytes = new_bytes;
+    bytes_capacity = new_capacity;
+}
+
+// Appends `count` uninitialized bytes, and returns a pointer to the first one
+static u8 *grow_bytes(size_t count) {
+    reserve_bytes(bytes_size + count);
+
+    u8 *start = bytes + bytes_size;
+    bytes_size += count;
+    return start;
+}
+
+static void push_span(const void *span, size_t count) {
+    memcpy(grow_bytes(count), span, count);
+}
+
+static void push(u8 byte) {
+    *grow_bytes(1) = byte;
 }
 
 static void push_zeros(size_t count) {
-    for (size_t i = 0; i < count; i++) {
-        push(0);
-    }
+    memset(grow_bytes(count), 0, count);
 }
 
-static void push_number(u64 n, size_t byte_count) {
-    while (n > 0) {
-        // Little-endian requires the least significant byte first
-        push(n & 0xff);
-        byte_count--;
+// Little-endian requires the least significant byte first
+static void store_u16(u8 *dest, u16 n) {
+    dest[0] = n;
+    dest[1] = n >> 8;
+}
 
-        n >>= 8; // Shift right by one byte
-    }
+static void store_u32(u8 *dest, u32 n) {
+    dest[0] = n;
+    dest[1] = n >> 8;
+    dest[2] = n >> 16;
+    dest[3] = n >> 24;
+}
+
+static void store_u64(u8 *dest, u64 n) {
+    store_u32(dest, n);
+    store_u32(dest + 4, n >> 32);
+}
 
-    // Optional padding
-    push_zeros(byte_count);
+static void push_u16(u16 n) {
+    store_u16(grow_bytes(2), n);
+}
+
+static void push_u32(u32 n) {
+    store_u32(grow_bytes(4), n);
+}
+
+static void push_u64(u64 n) {
+    store_u64(grow_bytes(8), n);
 }
 
 static void push_string(char *str) {
-    for (size_t i = 0; i < strlen(str); i++) {
-        push(str[i]);
-    }
-    push('\0');
+    push_span(str, strlen(str) + 1);
 }
 
 static void push_strtab() {
@@ -91,14 +133,14 @@ static void push_strtab() {
 // See https://docs.oracle.com/cd/E19683-01/816-1386/chapter6-79797/index.html
 // See https://docs.oracle.com/cd/E19683-01/816-1386/6m7qcoblj/index.html#chapter6-tbl-21
 static void push_symbol(u32 name, u16 info, u16 shndx) {
-    push_number(name, 4); // Indexed into .strtab, because .symtab its "link" points to it
-    push_number(info, 2);
-    push_number(shndx, 2);
+    push_u32(name); // Indexed into .strtab, because .symtab its "link" points to it
+    push_u16(info);
+    push_u16(shndx);
 
     // TODO: I'm confused by why we don't seem to need these
-    // push_number(value, 4);
-    // push_number(size, 4);
-    // push_number(other, 4);
+    // push_u32(value);
+    // push_u32(size);
+    // push_u32(other);
 
     push_zeros(24 - 8); // .symtab its entry_size is 24
 }
@@ -136,16 +178,16 @@ static void push_data() {
 }
 
 static void push_section(u32 name_offset, u32 type, u64 flags, u64 address, u64 offset, u64 size, u32 link, u32 info, u64 alignment, u64 entry_size) {
-    push_number(name_offset, 4);
-    push_number(type, 4);
-    push_number(flags, 8);
-    push_number(address, 8);
-    push_number(offset, 8);
-    push_number(size, 8);
-    push_number(link, 4);
-    push_number(info, 4);
-    push_number(alignment, 8);
-    push_number(entry_size, 8);
+    push_u32(name_offset);
+    push_u32(type);
+    push_u64(flags);
+    push_u64(address);
+    push_u64(offset);
+    push_u64(size);
+    push_u32(link);
+    push_u32(info);
+    push_u64(alignment);
+    push_u64(entry_size);
 }
 
 static void push_section_headers() {
@@ -173,73 +215,54 @@ static void push_section_headers() {
 }
 
 static void push_elf_header() {
-    // Magic number
-    push(0x7f);
-    push('E');
-    push('L');
-    push('F');
-
-    // 64-bit
-    push(2);
-
-    // Little-endian
-    push(1);
-
-    // Version
-    push(1);
-
-    // SysV OS ABI
-    push(0);
-
-    // Padding
-    push_zeros(8);
+    static const u8 ident[] = {
+        0x7f, 'E', 'L', 'F', // Magic number
+        2, // 64-bit
+        1, // Little-endian
+        1, // Version
+        0, // SysV OS ABI
+        0, 0, 0, 0, 0, 0, 0, 0, // Padding
+    };
+    push_span(ident, sizeof(ident));
 
     // Relocatable file
-    push(ET_REL);
-    push(0);
+    push_u16(ET_REL);
 
     // x86-64 instruction set architecture
-    push(0x3E);
-    push(0);
+    push_u16(0x3E);
 
     // Original version of ELF
-    push(1);
-    push_zeros(3);
+    push_u32(1);
 
     // No execution entry point address
-    push_zeros(8);
+    push_u64(0);
 
     // No program header table
-    push_zeros(8);
+    push_u64(0);
 
     // Section header table offset
-    push(0x40);
-    push_zeros(7);
+    push_u64(0x40);
 
     // Processor-specific flags
-    push_zeros(4);
+    push_u32(0);
 
     // ELF header size
-    push(0x40);
-    push(0);
+    push_u16(0x40);
 
     // Single program header size
-    push_zeros(2);
+    push_u16(0);
 
     // Number of program header entries
-    push_zeros(2);
+    push_u16(0);
 
     // Single section header entry size
-    push(0x40);
-    push(0);
+    push_u16(0x40);
 
     // Number of section header entries
-    push(5);
-    push(0);
+    push_u16(5);
 
     // Index of entry with section names
-    push(2);
-    push(0);
+    push_u16(2);
 }
 
 static void generate_simple_o() {
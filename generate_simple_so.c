@@ -65,30 +65,85 @@ typedef uint64_t u64;
 // https://docs.oracle.com/cd/E19683-01/816-1386/chapter6-79797/index.html
 #define ELF32_ST_INFO(bind, type) (((bind)<<4)+((type)&0xf))
 
-#define MAX_BYTES_SIZE 420420
-u8 bytes[MAX_BYTES_SIZE];
+#define MIN_BYTES_CAPACITY 0x1000
+u8 *bytes;
 size_t bytes_size = 0;
+size_t bytes_capacity = 0;
 
-static void push(u8 byte) {
-    if (bytes_size + 1 > MAX_BYTES_SIZE) {
-        fprintf(stderr, "error: MAX_BYTES_SIZE of %d was exceeded\n", MAX_BYTES_SIZE);
+// Makes sure at least `capacity` bytes fit, doubling the capacity so that pushing stays amortized O(1)
+static void reserve_bytes(size_t capacity) {
+    if (capacity <= bytes_capacity) {
+        return;
+    }
+
+    size_t new_capacity = bytes_capacity > 0 ? bytes_capacity : MIN_BYTES_CAPACITY;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+
+    u8 *new_bytes = realloc(bytes, new_capacity);
+    if (!new_bytes) {
+        perror("realloc");
         exit(EXIT_FAILURE);
     }
 
-    bytes[bytes_size++] = byte;
+    bytes = new_bytes;
+    bytes_capacity = new_capacity;
+}
+
+// Appends `count` uninitialized bytes, and returns a pointer to the first one
+static u8 *grow_bytes(size_t count) {
+    reserve_bytes(bytes_size + count);
+
+    u8 *start = bytes + bytes_size;
+    bytes_size += count;
+    return start;
+}
+
+static void push_span(const void *span, size_t count) {
+    memcpy(grow_bytes(count), span, count);
+}
+
+static void push(u8 byte) {
+    *grow_bytes(1) = byte;
 }
 
 static void push_zeros(size_t count) {
-    for (size_t i = 0; i < count; i++) {
-        push(0);
-    }
+    memset(grow_bytes(count), 0, count);
+}
+
+// Little-endian requires the least significant byte first
+static void store_u16(u8 *dest, u16 n) {
+    dest[0] = n;
+    dest[1] = n >> 8;
+}
+
+static void store_u32(u8 *dest, u32 n) {
+    dest[0] = n;
+    dest[1] = n >> 8;
+    dest[2] = n >> 16;
+    dest[3] = n >> 24;
+}
+
+static void store_u64(u8 *dest, u64 n) {
+    store_u32(dest, n);
+    store_u32(dest + 4, n >> 32);
+}
+
+static void push_u16(u16 n) {
+    store_u16(grow_bytes(2), n);
+}
+
+static void push_u32(u32 n) {
+    store_u32(grow_bytes(4), n);
+}
+
+static void push_u64(u64 n) {
+    store_u64(grow_bytes(8), n);
 }
 
 static void push_string(char *str) {
-    for (size_t i = 0; i < strlen(str); i++) {
-        push(str[i]);
-    }
-    push('\0');
+    push_span(str, strlen(str) + 1);
 }
 
 static void push_shstrtab() {
@@ -112,30 +167,17 @@ static void push_strtab() {
     push_string("a");
 }
 
-static void push_number(u64 n, size_t byte_count) {
-    while (n > 0) {
-        // Little-endian requires the least significant byte first
-        push(n & 0xff);
-        byte_count--;
-
-        n >>= 8; // Shift right by one byte
-    }
-
-    // Optional padding
-    push_zeros(byte_count);
-}
-
 // See https://docs.oracle.com/cd/E19683-01/816-1386/chapter6-79797/index.html
 // See https://docs.oracle.com/cd/E19683-01/816-1386/6m7qcoblj/index.html#chapter6-tbl-21
 static void push_symbol(u32 name, u16 info, u16 shndx, u32 value) {
-    push_number(name, 4); // Indexed into .strtab, because .symtab its "link" points to it
-    push_number(info, 2);
-    push_number(shndx, 2);
-    push_number(value, 4); // In executable and shared object files, st_value holds a virtual address
+    push_u32(name); // Indexed into .strtab, because .symtab its "link" points to it
+    push_u16(info);
+    push_u16(shndx);
+    push_u32(value); // In executable and shared object files, st_value holds a virtual address
 
     // TODO: I'm confused by why we don't seem to need these
-    // push_number(size, 4);
-    // push_number(other, 4);
+    // push_u32(size);
+    // push_u32(other);
 
     push_zeros(24 - 12); // .symtab its entry_size is 24
 }
@@ -169,8 +211,8 @@ static void push_data() {
 
 // See https://docs.oracle.com/cd/E23824_01/html/819-0690/chapter6-42444.html
 static void push_dynamic_entry(u64 tag, u64 value) {
-    push_number(tag, 8);
-    push_number(value, 8);
+    push_u64(tag);
+    push_u64(value);
 }
 
 static void push_dynamic() {
@@ -206,25 +248,25 @@ static void push_dynsym() {
 // See https://flapenguin.me/elf-dt-hash
 // See https://refspecs.linuxfoundation.org/elf/gabi4+/ch5.dynamic.html#hash
 static void push_hash() {
-    push_number(1, 4); // nbucket
-    push_number(2, 4); // nchain, which is 2 because there is "<null>" and "a" in dynsym
-    push_number(1, 4); // bucket[0] => 1, so dynsym[1] => "a"
-    push_number(0, 4); // chain[0] is always 0
-    push_number(0, 4); // chain[1] is 0, since if the symbol didn't match "a", there is no possible other match
+    push_u32(1); // nbucket
+    push_u32(2); // nchain, which is 2 because there is "<null>" and "a" in dynsym
+    push_u32(1); // bucket[0] => 1, so dynsym[1] => "a"
+    push_u32(0); // chain[0] is always 0
+    push_u32(0); // chain[1] is 0, since if the symbol didn't match "a", there is no possible other match
     push_zeros(4); // Alignment
 }
 
 static void push_section(u32 name_offset, u32 type, u64 flags, u64 address, u64 offset, u64 size, u32 link, u32 info, u64 alignment, u64 entry_size) {
-    push_number(name_offset, 4);
-    push_number(type, 4);
-    push_number(flags, 8);
-    push_number(address, 8);
-    push_number(offset, 8);
-    push_number(size, 8);
-    push_number(link, 4);
-    push_number(info, 4);
-    push_number(alignment, 8);
-    push_number(entry_size, 8);
+    push_u32(name_offset);
+    push_u32(type);
+    push_u64(flags);
+    push_u64(address);
+    push_u64(offset);
+    push_u64(size);
+    push_u32(link);
+    push_u32(info);
+    push_u64(alignment);
+    push_u64(entry_size);
 }
 
 static void push_section_headers() {
@@ -272,88 +314,65 @@ static void push_section_headers() {
 }
 
 static void push_program_header(u32 type, u32 flags, u64 offset, u64 virtual_address, u64 physical_address, u64 file_size, u64 mem_size, u64 alignment) {
-    push_number(type, 4);
-    push_number(flags, 4);
-    push_number(offset, 8);
-    push_number(virtual_address, 8);
-    push_number(physical_address, 8);
-    push_number(file_size, 8);
-    push_number(mem_size, 8);
-    push_number(alignment, 8);
+    push_u32(type);
+    push_u32(flags);
+    push_u64(offset);
+    push_u64(virtual_address);
+    push_u64(physical_address);
+    push_u64(file_size);
+    push_u64(mem_size);
+    push_u64(alignment);
 }
 
 static void push_elf_header() {
-    // Magic number
-    push(0x7f);
-    push('E');
-    push('L');
-    push('F');
-
-    // 64-bit
-    push(2);
-
-    // Little-endian
-    push(1);
-
-    // Version
-    push(1);
-
-    // SysV OS ABI
-    push(0);
-
-    // Padding
-    push_zeros(8);
+    static const u8 ident[] = {
+        0x7f, 'E', 'L', 'F', // Magic number
+        2, // 64-bit
+        1, // Little-endian
+        1, // Version
+        0, // SysV OS ABI
+        0, 0, 0, 0, 0, 0, 0, 0, // Padding
+    };
+    push_span(ident, sizeof(ident));
 
     // Shared object
-    push(ET_DYN);
-    push(0);
+    push_u16(ET_DYN);
 
     // x86-64 instruction set architecture
-    push(0x3E);
-    push(0);
+    push_u16(0x3E);
 
     // Original version of ELF
-    push(1);
-    push_zeros(3);
+    push_u32(1);
 
     // No execution entry point address
-    push_zeros(8);
+    push_u64(0);
 
     // Program header table offset
-    push(0x40);
-    push_zeros(7);
+    push_u64(0x40);
 
     // Section header table offset
-    push(0xe0);
-    push(0x20);
-    push_zeros(6);
+    push_u64(0x20e0);
 
     // Processor-specific flags
-    push_zeros(4);
+    push_u32(0);
 
     // ELF header size
-    push(0x40);
-    push(0);
+    push_u16(0x40);
 
     // Single program header size
-    push(0x38);
-    push(0);
+    push_u16(0x38);
 
     // Number of program header entries
-    push(4);
-    push(0);
+    push_u16(4);
 
     // Single section header entry size
-    push(0x40);
-    push(0);
+    push_u16(0x40);
 
     // Number of section header entries
-    push(10);
-    push(0);
+    push_u16(10);
 
     // Index of entry with section names
-    push(9);
-    push(0);
+    push_u16(9);
 }
 
 static void generate_simple_so() {
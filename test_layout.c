@@ -0,0 +1,404 @@
+// Checks the layouts that generate_full_so.c picks for sources that full.s doesn't cover,
+// by reading the program headers of the output, by loading it with dlopen(),
+// and by comparing it with the output of `as` + `ld -shared --hash-style=sysv`, which is skipped when they aren't installed
+//
+// The generator runs in a child process, since it exits when it rejects a source
+// Prints every failed check, and exits with EXIT_FAILURE when there was one
+
+#define GENERATE_FULL_SO_NO_MAIN
+#include "generate_full_so.c"
+
+#include <dlfcn.h>
+#include <sys/wait.h>
+
+#define MAX_OUTPUT_SIZE 0x100000
+#define MAX_TESTS 64
+
+static char directory[] = "/tmp/test_layout_XXXXXX";
+
+static u8 output[MAX_OUTPUT_SIZE];
+static size_t output_size;
+
+static u8 ld_output[MAX_OUTPUT_SIZE];
+static size_t ld_output_size;
+
+static size_t failure_count;
+
+// So the sources and outputs can be removed when every check passed
+static char *test_names[MAX_TESTS];
+static size_t test_names_size;
+
+static void check(bool condition, char *test_name, char *description) {
+    if (!condition) {
+        fprintf(stderr, "FAIL %s: %s\n", test_name, description);
+        failure_count++;
+    }
+}
+
+static void write_source(char *path, char *text) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    fputs(text, f);
+    fclose(f);
+}
+
+static size_t read_file(char *path, u8 *buffer) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = fread(buffer, 1, MAX_OUTPUT_SIZE, f);
+    fclose(f);
+    return size;
+}
+
+// Returns the exit status of the generator, whose error messages are hidden,
+// since the tests that expect an error would otherwise clutter the output
+static int run_generator(char *test_name, char *source, bool separate_code) {
+    char source_path[4096];
+    char output_path[4096];
+    snprintf(source_path, sizeof(source_path), "%s/%s.s", directory, test_name);
+    snprintf(output_path, sizeof(output_path), "%s/%s.so", directory, test_name);
+    write_source(source_path, source);
+
+    if (test_names_size >= MAX_TESTS) {
+        fprintf(stderr, "error: There are more than %d tests\n", MAX_TESTS);
+        exit(EXIT_FAILURE);
+    }
+    test_names[test_names_size++] = test_name;
+
+    // So the checks of a failed run don't see the output of the previous one
+    memset(output, 0, sizeof(output));
+    output_size = 0;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        if (!freopen("/dev/null", "w", stderr)) {
+            _exit(EXIT_FAILURE);
+        }
+        struct context *options = create_context();
+        options->separate_code = separate_code;
+        generate_full_so_file(source_path, output_path, options);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    if (!WIFEXITED(status)) {
+        return EXIT_FAILURE;
+    }
+
+    if (WEXITSTATUS(status) == EXIT_SUCCESS) {
+        output_size = read_file(output_path, output);
+    }
+    return WEXITSTATUS(status);
+}
+
+static size_t get_program_header_count(void) {
+    return output[56] | output[57] << 8; // e_phnum
+}
+
+static u8 *get_program_header(size_t index) {
+    return output + ELF_HEADER_SIZE + index * PROGRAM_HEADER_SIZE;
+}
+
+static size_t count_loads(u32 flags) {
+    size_t count = 0;
+    for (size_t i = 0; i < get_program_header_count(); i++) {
+        u8 *header = get_program_header(i);
+        if (load_u32(header) == PT_LOAD && load_u32(header + 4) == flags) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static bool has_empty_load(void) {
+    for (size_t i = 0; i < get_program_header_count(); i++) {
+        u8 *header = get_program_header(i);
+        if (load_u32(header) == PT_LOAD && load_u64(header + 40) == 0) { // p_memsz
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the address of the first section that occupies no space in the file, which is .bss
+static u64 get_bss_address(void) {
+    u64 section_headers_offset = load_u64(output + 40); // e_shoff
+    size_t section_count = output[60] | output[61] << 8; // e_shnum
+
+    for (size_t i = 0; i < section_count; i++) {
+        u8 *header = output + section_headers_offset + i * SECTION_HEADER_SIZE;
+        if (load_u32(header + 4) == SHT_NOBITS) {
+            return load_u64(header + 16); // sh_addr
+        }
+    }
+    return 0;
+}
+
+// Returns where the writable PT_LOAD ends in memory
+static u64 get_writable_load_end(void) {
+    for (size_t i = 0; i < get_program_header_count(); i++) {
+        u8 *header = get_program_header(i);
+        if (load_u32(header) == PT_LOAD && load_u32(header + 4) == (PF_R | PF_W)) {
+            return load_u64(header + 16) + load_u64(header + 40); // p_vaddr + p_memsz
+        }
+    }
+    return 0;
+}
+
+// Returns the exit status of the command, which is 127 when it couldn't be executed
+static int run_command(char *argv[]) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+// Links the GNU as version of the source of the test with ld, into ld_output
+// The .file directive is added, since ld puts it in .symtab where the generator puts the source path
+// Returns false when as or ld couldn't be executed
+static bool run_as_and_ld(char *test_name, char *gas_source, bool separate_code) {
+    char source_path[4096];
+    char gas_source_path[4096];
+    char object_path[4096];
+    char output_path[4096];
+    snprintf(source_path, sizeof(source_path), "%s/%s.s", directory, test_name);
+    snprintf(gas_source_path, sizeof(gas_source_path), "%s/%s.S", directory, test_name);
+    snprintf(object_path, sizeof(object_path), "%s/%s.o", directory, test_name);
+    snprintf(output_path, sizeof(output_path), "%s/%s.ld.so", directory, test_name);
+
+    FILE *f = fopen(gas_source_path, "w");
+    if (!f) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(f, ".file \"%s\"\n%s", source_path, gas_source);
+    fclose(f);
+
+    char *as_argv[] = {"as", gas_source_path, "-o", object_path, NULL};
+    int status = run_command(as_argv);
+    if (status == 127) {
+        return false;
+    }
+    check(status == EXIT_SUCCESS, test_name, "as failed");
+
+    char *separate_code_argument = separate_code ? "separate-code" : "noseparate-code";
+    char *ld_argv[] = {"ld", "-shared", "--hash-style=sysv", "-z", separate_code_argument, object_path, "-o", output_path, NULL};
+    status = run_command(ld_argv);
+    if (status == 127) {
+        return false;
+    }
+    check(status == EXIT_SUCCESS, test_name, "ld failed");
+
+    ld_output_size = status == EXIT_SUCCESS ? read_file(output_path, ld_output) : 0;
+    return true;
+}
+
+// Returns the first byte of the symbol, after loading the output with dlopen()
+static int load_first_byte(char *test_name, char *symbol_name) {
+    char output_path[4096];
+    snprintf(output_path, sizeof(output_path), "%s/%s.so", directory, test_name);
+
+    void *handle = dlopen(output_path, RTLD_NOW);
+    if (!handle) {
+        fprintf(stderr, "FAIL %s: %s\n", test_name, dlerror());
+        failure_count++;
+        return -1;
+    }
+
+    u8 *symbol = dlsym(handle, symbol_name);
+    int byte = symbol ? *symbol : -1;
+    dlclose(handle);
+    return byte;
+}
+
+// ld leaves out the .text segment when there is no code, and then merges the read-only data into the first segment
+static void test_empty_text(void) {
+    char *source =
+        "global d\n"
+        "section .data\n"
+        "d: db 42\n";
+
+    check(run_generator("empty_text", source, true) == EXIT_SUCCESS, "empty_text", "the generator failed");
+    check(get_program_header_count() == 4, "empty_text", "expected the first and writable PT_LOAD, PT_DYNAMIC and PT_GNU_RELRO");
+    check(count_loads(PF_R | PF_X) == 0, "empty_text", "expected no executable PT_LOAD");
+    check(!has_empty_load(), "empty_text", "expected no empty PT_LOAD");
+    check(load_first_byte("empty_text", "d") == 42, "empty_text", "expected d to be 42");
+
+    source =
+        "global d\n"
+        "global r\n"
+        "section .rodata\n"
+        "r: db 7\n"
+        "section .data\n"
+        "d: db 42\n";
+
+    check(run_generator("empty_text_rodata", source, true) == EXIT_SUCCESS, "empty_text_rodata", "the generator failed");
+    check(get_program_header_count() == 4, "empty_text_rodata", "expected .rodata to be merged into the first PT_LOAD");
+    check(count_loads(PF_R | PF_X) == 0, "empty_text_rodata", "expected no executable PT_LOAD");
+    check(load_first_byte("empty_text_rodata", "r") == 7, "empty_text_rodata", "expected r to be 7");
+
+    check(run_generator("empty_text_compact", source, false) == EXIT_SUCCESS, "empty_text_compact", "the generator failed");
+    check(count_loads(PF_R) == 1 && count_loads(PF_R | PF_X) == 0, "empty_text_compact", "expected the first PT_LOAD to not be executable");
+    check(load_first_byte("empty_text_compact", "r") == 7, "empty_text_compact", "expected r to be 7");
+}
+
+// Without .rodata ld still emits the read-only segment after .text, for its empty .eh_frame
+static void test_text_without_rodata(void) {
+    char *source =
+        "global f\n"
+        "global d\n"
+        "section .text\n"
+        "f: ret\n"
+        "section .data\n"
+        "d: db 42\n";
+
+    check(run_generator("text_without_rodata", source, true) == EXIT_SUCCESS, "text_without_rodata", "the generator failed");
+    check(get_program_header_count() == 6, "text_without_rodata", "expected ld its three PT_LOAD segments before the writable one, PT_DYNAMIC and PT_GNU_RELRO");
+    check(count_loads(PF_R | PF_X) == 1, "text_without_rodata", "expected one executable PT_LOAD");
+    check(count_loads(PF_R) == 2 && has_empty_load(), "text_without_rodata", "expected an empty read-only PT_LOAD for .eh_frame");
+    check(load_first_byte("text_without_rodata", "d") == 42, "text_without_rodata", "expected d to be 42");
+}
+
+// The symbol values are only 32 bits, so the sections have to end below 4 GiB,
+// which .bss reaches first, since it comes last
+static void test_bss_end_boundary(void) {
+    char source[256];
+    char *format =
+        "global d\n"
+        "global b\n"
+        "global e\n"
+        "section .data\n"
+        "d: db 42\n"
+        "section .bss\n"
+        "b: resb %llu\n"
+        "e:\n";
+
+    // Where .bss starts doesn't depend on its size
+    snprintf(source, sizeof(source), format, 1ULL);
+    check(run_generator("bss_start", source, true) == EXIT_SUCCESS, "bss_start", "the generator failed");
+    u64 bss_address = get_bss_address();
+    check(bss_address > 0, "bss_start", "expected a .bss");
+
+    // The end of .bss is padded until it is 8-byte aligned, and e is at its end
+    u64 last_end = UINT32_MAX & ~7ULL;
+
+    snprintf(source, sizeof(source), format, (unsigned long long)(last_end - bss_address));
+    check(run_generator("bss_end_below_4_gib", source, true) == EXIT_SUCCESS, "bss_end_below_4_gib", "the generator failed");
+    check(get_writable_load_end() == last_end, "bss_end_below_4_gib", "expected the writable PT_LOAD to end right before 4 GiB");
+
+    snprintf(source, sizeof(source), format, (unsigned long long)(last_end - bss_address + 1));
+    check(run_generator("bss_end_past_4_gib", source, true) == EXIT_FAILURE, "bss_end_past_4_gib", "expected the generator to reject the source");
+}
+
+// Every default layout has to be byte for byte the same as ld its output,
+// including the sources without .rodata, where ld still emits a read-only segment after .text for its empty .eh_frame
+static void test_matches_ld(void) {
+    struct {
+        char *test_name;
+        char *source;
+        char *gas_source;
+        bool separate_code;
+    } cases[] = {
+        {
+            "ld_text_without_rodata",
+            "global f\n" "global d\n" "section .text\n" "f: ret\n" "section .data\n" "d: db 42\n",
+            ".globl f\n" ".globl d\n" ".text\n" ".p2align 4\n" "f: ret\n" ".data\n" ".p2align 2\n" "d: .byte 42\n",
+            true,
+        },
+        {
+            "ld_text_without_rodata_compact",
+            "global f\n" "global d\n" "section .text\n" "f: ret\n" "section .data\n" "d: db 42\n",
+            ".globl f\n" ".globl d\n" ".text\n" ".p2align 4\n" "f: ret\n" ".data\n" ".p2align 2\n" "d: .byte 42\n",
+            false,
+        },
+        {
+            "ld_text_with_rodata",
+            "global f\n" "global r\n" "section .text\n" "f: ret\n" "section .rodata\n" "r: db 7\n",
+            ".globl f\n" ".globl r\n" ".text\n" ".p2align 4\n" "f: ret\n" ".section .rodata\n" ".p2align 2\n" "r: .byte 7\n",
+            true,
+        },
+        {
+            "ld_empty_text",
+            "global r\n" "global d\n" "section .rodata\n" "r: db 7\n" "section .data\n" "d: db 42\n",
+            ".globl r\n" ".globl d\n" ".section .rodata\n" ".p2align 2\n" "r: .byte 7\n" ".data\n" ".p2align 2\n" "d: .byte 42\n",
+            true,
+        },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+        char *test_name = cases[i].test_name;
+
+        check(run_generator(test_name, cases[i].source, cases[i].separate_code) == EXIT_SUCCESS, test_name, "the generator failed");
+        if (!run_as_and_ld(test_name, cases[i].gas_source, cases[i].separate_code)) {
+            printf("as or ld isn't installed, so the comparisons with ld are skipped\n");
+            return;
+        }
+
+        size_t ld_program_header_count = ld_output[56] | ld_output[57] << 8; // e_phnum
+        check(get_program_header_count() == ld_program_header_count, test_name, "expected ld its program header count");
+        for (size_t j = 0; j < ld_program_header_count && j < get_program_header_count(); j++) {
+            u8 *ld_program_header = ld_output + ELF_HEADER_SIZE + j * PROGRAM_HEADER_SIZE;
+            check(memcmp(get_program_header(j), ld_program_header, PROGRAM_HEADER_SIZE) == 0, test_name, "expected the offsets and sizes of ld its program headers");
+        }
+        check(output_size == ld_output_size && memcmp(output, ld_output, output_size) == 0, test_name, "expected the same bytes as ld its output");
+    }
+}
+
+int main(void) {
+    if (!mkdtemp(directory)) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+
+    test_empty_text();
+    test_text_without_rodata();
+    test_bss_end_boundary();
+    test_matches_ld();
+
+    if (failure_count > 0) {
+        fprintf(stderr, "%zu checks failed, the outputs are in %s\n", failure_count, directory);
+        exit(EXIT_FAILURE);
+    }
+
+    char *extensions[] = {"s", "so", "S", "o", "ld.so"};
+    char path[4096];
+    for (size_t i = 0; i < test_names_size; i++) {
+        for (size_t j = 0; j < sizeof(extensions) / sizeof(*extensions); j++) {
+            snprintf(path, sizeof(path), "%s/%s.%s", directory, test_names[i], extensions[j]);
+            unlink(path);
+        }
+    }
+    rmdir(directory);
+
+    printf("All checks passed\n");
+}